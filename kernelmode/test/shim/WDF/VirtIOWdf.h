@@ -0,0 +1,33 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <osdep.h>
+
+typedef struct WDFREQUEST__* WDFREQUEST;
+typedef struct WDFFILEOBJECT__* WDFFILEOBJECT;
+typedef struct WDFSPINLOCK__* WDFSPINLOCK;
+typedef struct WDFINTERRUPT__* WDFINTERRUPT;
+
+typedef struct virtio_wdf_driver {
+    int Unused;
+} VIRTIO_WDF_DRIVER, * PVIRTIO_WDF_DRIVER;
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(Type, Casting) Type* Casting(PVOID Handle);
+
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST Request);
@@ -0,0 +1,201 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+// just enough of the kernel for the lock-free code of the driver to run in user mode,
+// every thread of a test stands for one processor which never leaves dispatch level early
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHIM_MAX_PROCESSORS     64
+
+typedef void VOID;
+typedef void* PVOID;
+typedef char CHAR, * PCHAR;
+typedef unsigned char UCHAR, * PUCHAR, BOOLEAN, * PBOOLEAN, UINT8, * PUINT8;
+typedef unsigned short USHORT, UINT16, WCHAR;
+typedef int INT, INT32, LONG, * PLONG;
+typedef unsigned int UINT, UINT32, * PUINT32, ULONG, * PULONG, ULONG32, * PULONG32;
+typedef long long LONGLONG, LONG64, * PLONG64;
+typedef unsigned long long ULONGLONG, ULONG64, * PULONG64, UINT64;
+typedef size_t SIZE_T, * PSIZE_T;
+typedef uintptr_t ULONG_PTR, KAFFINITY;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, * PKIRQL;
+typedef volatile LONG KSPIN_LOCK, * PKSPIN_LOCK;
+typedef void* HANDLE;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, * PLARGE_INTEGER, PHYSICAL_ADDRESS, * PPHYSICAL_ADDRESS;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* volatile Flink;
+    struct _LIST_ENTRY* volatile Blink;
+} LIST_ENTRY, * PLIST_ENTRY;
+
+typedef struct _SLIST_ENTRY {
+    struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, * PSLIST_ENTRY;
+
+typedef struct _SLIST_HEADER {
+    PSLIST_ENTRY volatile Next;
+} SLIST_HEADER, * PSLIST_HEADER;
+
+typedef struct _KEVENT {
+    volatile LONG State;
+} KEVENT, * PKEVENT, * PRKEVENT;
+
+typedef struct _KTIMER { int Unused; } KTIMER, * PKTIMER;
+typedef struct _KDPC { int Unused; } KDPC, * PKDPC;
+typedef struct _MDL { int Unused; } MDL, * PMDL;
+typedef struct _LOOKASIDE_LIST_EX { int Unused; } LOOKASIDE_LIST_EX, * PLOOKASIDE_LIST_EX;
+typedef struct _GUID { ULONG Data1; USHORT Data2, Data3; UCHAR Data4[8]; } GUID;
+typedef struct _PROCESSOR_NUMBER { USHORT Group; UCHAR Number; UCHAR Reserved; } PROCESSOR_NUMBER, * PPROCESSOR_NUMBER;
+typedef struct _IO_WORKITEM* PIO_WORKITEM;
+typedef struct _KTHREAD* PKTHREAD;
+
+typedef enum { NotificationEvent, SynchronizationEvent } EVENT_TYPE;
+typedef enum { MmNonCached, MmCached, MmWriteCombined } MEMORY_CACHING_TYPE;
+
+#define IN
+#define OUT
+#define TRUE                            1
+#define FALSE                           0
+#define FORCEINLINE                     static inline
+#define ANYSIZE_ARRAY                   1
+#define MAXLONG64                       0x7fffffffffffffffLL
+#define PAGE_SIZE                       4096
+#define PASSIVE_LEVEL                   0
+#define DISPATCH_LEVEL                  2
+#define IO_NO_INCREMENT                 0
+#define ALL_PROCESSOR_GROUPS            0xffff
+#define POOL_FLAG_NON_PAGED             0x40ULL
+#define POOL_FLAG_UNINITIALIZED         0x2ULL
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+#define UNREFERENCED_PARAMETER(P)       ((void)(P))
+#define FIELD_OFFSET(Type, Field)       ((LONG)offsetof(Type, Field))
+#define CONTAINING_RECORD(Address, Type, Field) ((Type*)((PCHAR)(Address) - offsetof(Type, Field)))
+#define RtlCopyMemory(Destination, Source, Length)  memcpy((Destination), (Source), (Length))
+#define RtlZeroMemory(Destination, Length)          memset((Destination), 0, (Length))
+#define KdPrint(Args)                   ((void)0)
+#define KeMemoryBarrier()               __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define YieldProcessor()                sched_yield()
+#define CTL_CODE(DeviceType, Function, Method, Access) (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define FILE_DEVICE_UNKNOWN             0x00000022
+#define METHOD_BUFFERED                 0
+#define METHOD_IN_DIRECT                1
+#define METHOD_OUT_DIRECT               2
+#define FILE_ANY_ACCESS                 0
+
+#define ASSERT(Expression) \
+    ((Expression) ? (void)0 : (fprintf(stderr, "assertion failed: %s %s:%d\n", #Expression, __FILE__, __LINE__), abort()))
+
+// the processor a test thread stands for and the irql it runs at
+extern __thread ULONG ShimProcessorIndex;
+extern __thread KIRQL ShimIrql;
+
+FORCEINLINE LONG InterlockedIncrement(LONG volatile* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedDecrement(LONG volatile* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(LONG volatile* Target, LONG Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedCompareExchange(LONG volatile* Destination, LONG Exchange, LONG Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+FORCEINLINE LONG64 InterlockedIncrement64(LONG64 volatile* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedDecrement64(LONG64 volatile* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedAdd64(LONG64 volatile* Addend, LONG64 Value) { return __atomic_add_fetch(Addend, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchange64(LONG64 volatile* Target, LONG64 Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedCompareExchange64(LONG64 volatile* Destination, LONG64 Exchange, LONG64 Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile* Target, PVOID Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+
+FORCEINLINE KIRQL KeGetCurrentIrql() { return ShimIrql; }
+FORCEINLINE VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql) { *OldIrql = ShimIrql; ShimIrql = NewIrql; }
+FORCEINLINE VOID KeLowerIrql(KIRQL NewIrql) { ShimIrql = NewIrql; }
+FORCEINLINE ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber) { UNREFERENCED_PARAMETER(ProcNumber); return ShimProcessorIndex; }
+FORCEINLINE ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber) { UNREFERENCED_PARAMETER(GroupNumber); return SHIM_MAX_PROCESSORS; }
+FORCEINLINE VOID KeStallExecutionProcessor(ULONG MicroSeconds) { usleep(MicroSeconds); }
+
+FORCEINLINE VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock) { *SpinLock = 0; }
+FORCEINLINE VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+FORCEINLINE VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock) { __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE); }
+FORCEINLINE VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql) { KeRaiseIrql(DISPATCH_LEVEL, OldIrql); KeAcquireSpinLockAtDpcLevel(SpinLock); }
+FORCEINLINE VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql) { KeReleaseSpinLockFromDpcLevel(SpinLock); KeLowerIrql(NewIrql); }
+
+FORCEINLINE VOID KeInitializeEvent(PKEVENT Event, EVENT_TYPE Type, BOOLEAN State) { UNREFERENCED_PARAMETER(Type); Event->State = State; }
+FORCEINLINE LONG KeSetEvent(PKEVENT Event, LONG Increment, BOOLEAN Wait) { UNREFERENCED_PARAMETER(Increment); UNREFERENCED_PARAMETER(Wait); return InterlockedExchange(&Event->State, 1); }
+FORCEINLINE VOID KeClearEvent(PKEVENT Event) { InterlockedExchange(&Event->State, 0); }
+FORCEINLINE LONG KeReadStateEvent(PKEVENT Event) { return Event->State; }
+
+FORCEINLINE PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    return (Flags & POOL_FLAG_UNINITIALIZED) ? malloc(NumberOfBytes) : calloc(1, NumberOfBytes);
+}
+FORCEINLINE VOID ExFreePoolWithTag(PVOID P, ULONG Tag) { UNREFERENCED_PARAMETER(Tag); free(P); }
+
+FORCEINLINE VOID InitializeListHead(PLIST_ENTRY ListHead) { ListHead->Flink = ListHead->Blink = ListHead; }
+FORCEINLINE BOOLEAN IsListEmpty(const LIST_ENTRY* ListHead) { return ListHead->Flink == ListHead; }
+FORCEINLINE VOID RemoveEntryListUnsafe(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY flink = Entry->Flink;
+    PLIST_ENTRY blink = Entry->Blink;
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+}
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY Entry) { RemoveEntryListUnsafe(Entry); return Entry->Flink == Entry->Blink; }
+FORCEINLINE PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead) { PLIST_ENTRY entry = ListHead->Flink; RemoveEntryListUnsafe(entry); return entry; }
+FORCEINLINE VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+FORCEINLINE VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead;
+    Entry->Blink = ListHead->Blink;
+    ListHead->Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
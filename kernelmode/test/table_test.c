@@ -0,0 +1,352 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "control.h"
+#include "table.h"
+
+// stress the epoch and the resource table of the driver: readers look resources up without
+// locks while writers create, close and drop them, which also grows and rebuilds the table
+#define NUM_READERS         6
+#define NUM_WRITERS         2
+#define WRITER_ROUNDS       200000
+#define WRITER_LIVE_MAX     96
+#define WRITER_CLOSED_MAX   16
+#define READER_ID_WINDOW    512
+#define RESOURCE_MAGIC      0x52534552
+
+__thread ULONG ShimProcessorIndex;
+__thread KIRQL ShimIrql;
+
+static VIRGL_CONTEXT    TestContext;
+static volatile LONG    NextId = 1;
+static volatile LONG    bWritersDone = FALSE;
+static volatile LONG64  CreatedCount = 0;
+static volatile LONG64  FreedCount = 0;
+static volatile LONG64  LookupCount = 0;
+static volatile LONG64  FoundCount = 0;
+
+static VOID Fail(const char* Message, ULONG32 Id)
+{
+    fprintf(stderr, "table_test: %s id=%u\n", Message, Id);
+    abort();
+}
+
+static VOID FreeTestResourceCallback(PEPOCH_ENTRY Entry, PVOID FreeContext)
+{
+    PVIRGL_RESOURCE resource = CONTAINING_RECORD(Entry, VIRGL_RESOURCE, RetireEntry);
+
+    UNREFERENCED_PARAMETER(FreeContext);
+
+    // a reader still using the resource would see the poison
+    memset(resource, 0xdd, sizeof(VIRGL_RESOURCE));
+    free(resource);
+    InterlockedIncrement64(&FreedCount);
+}
+
+// the driver sends the destroy commands here, the test only retires the memory
+VOID PutResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+{
+    UNREFERENCED_PARAMETER(VirglContext);
+
+    if (Resource->RefCount <= 0 || Resource->Key.Size != RESOURCE_MAGIC)
+    {
+        Fail("put of a dead resource", Resource->Id);
+    }
+
+    if (InterlockedDecrement(&Resource->RefCount) == 0)
+    {
+        EpochRetire(&Resource->RetireEntry, FreeTestResourceCallback, NULL);
+    }
+}
+
+static PVIRGL_RESOURCE CreateTestResource()
+{
+    PVIRGL_RESOURCE resource = calloc(1, sizeof(VIRGL_RESOURCE));
+
+    if (!resource)
+    {
+        Fail("allocate resource failed", 0);
+    }
+
+    resource->Id = (ULONG32)InterlockedIncrement(&NextId);
+    resource->RefCount = 1;
+    resource->Key.Size = RESOURCE_MAGIC;
+    if (!InsertResource(&TestContext, resource))
+    {
+        Fail("insert resource failed", resource->Id);
+    }
+
+    InterlockedIncrement64(&CreatedCount);
+    return resource;
+}
+
+// a closed resource stays in the table until its last fence, like the retire list of the driver
+static VOID CloseTestResource(PVIRGL_RESOURCE Resource)
+{
+    KIRQL savedIrql;
+
+    SpinLock(&savedIrql, &TestContext.ResourceListSpinLock);
+    Resource->bClosed = TRUE;
+    SpinUnLock(savedIrql, &TestContext.ResourceListSpinLock);
+}
+
+static VOID RemoveTestResource(PVIRGL_RESOURCE Resource)
+{
+    KIRQL savedIrql;
+
+    SpinLock(&savedIrql, &TestContext.ResourceListSpinLock);
+    RemoveResourceUnsafe(&TestContext, Resource);
+    SpinUnLock(savedIrql, &TestContext.ResourceListSpinLock);
+
+    PutResource(&TestContext, Resource);
+}
+
+static PVOID WriterRoutine(PVOID Parameter)
+{
+    ULONG           liveCount = 0, closedCount = 0;
+    PVIRGL_RESOURCE live[WRITER_LIVE_MAX];
+    PVIRGL_RESOURCE closed[WRITER_CLOSED_MAX];
+    unsigned int    seed = (unsigned int)(ULONG_PTR)Parameter;
+
+    ShimProcessorIndex = (ULONG)(ULONG_PTR)Parameter;
+    ShimIrql = PASSIVE_LEVEL;
+
+    for (ULONG round = 0; round < WRITER_ROUNDS; round++)
+    {
+        // give the readers a turn even on a single processor
+        if (round % 4 == 0)
+        {
+            sched_yield();
+        }
+
+        if (liveCount < WRITER_LIVE_MAX && rand_r(&seed) % WRITER_LIVE_MAX >= liveCount)
+        {
+            live[liveCount++] = CreateTestResource();
+            continue;
+        }
+
+        // keep about half of the live slots used, close a random live resource and drop the oldest closed one from the table
+        ULONG index = rand_r(&seed) % liveCount;
+        PVIRGL_RESOURCE resource = live[index];
+        live[index] = live[--liveCount];
+
+        CloseTestResource(resource);
+        if (closedCount == WRITER_CLOSED_MAX)
+        {
+            RemoveTestResource(closed[0]);
+            memmove(&closed[0], &closed[1], (WRITER_CLOSED_MAX - 1) * sizeof(PVIRGL_RESOURCE));
+            closedCount--;
+        }
+        closed[closedCount++] = resource;
+    }
+
+    while (closedCount > 0)
+    {
+        RemoveTestResource(closed[--closedCount]);
+    }
+
+    while (liveCount > 0)
+    {
+        CloseTestResource(live[--liveCount]);
+        RemoveTestResource(live[liveCount]);
+    }
+
+    return NULL;
+}
+
+// look the resource up inside a read section and stay there a while, the writers must not free it meanwhile
+static VOID ProbeTestResource(ULONG32 Id)
+{
+    KIRQL           oldIrql;
+    PVIRGL_RESOURCE resource;
+
+    EpochEnter(&oldIrql);
+    resource = GetResourceFromListUnsafe(&TestContext, Id);
+    if (resource)
+    {
+        sched_yield();
+        if (resource->Id != Id || resource->Key.Size != RESOURCE_MAGIC)
+        {
+            Fail("resource freed inside a read section", Id);
+        }
+    }
+    EpochExit(oldIrql);
+}
+
+static PVOID ReaderRoutine(PVOID Parameter)
+{
+    ULONG32         id, top;
+    PVIRGL_RESOURCE resource;
+    unsigned int    seed = (unsigned int)(ULONG_PTR)Parameter;
+
+    ShimProcessorIndex = (ULONG)(ULONG_PTR)Parameter;
+    ShimIrql = PASSIVE_LEVEL;
+
+    while (!bWritersDone)
+    {
+        top = (ULONG32)NextId;
+        id = top > READER_ID_WINDOW ? top - rand_r(&seed) % READER_ID_WINDOW : 1 + rand_r(&seed) % top;
+
+        if (id % 2 == 0)
+        {
+            ProbeTestResource(id);
+        }
+
+        resource = GetResourceFromList(&TestContext, id);
+        InterlockedIncrement64(&LookupCount);
+        if (!resource)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // the reference keeps the resource alive whatever the writers do meanwhile
+        if (resource->Id != id || resource->Key.Size != RESOURCE_MAGIC || resource->RefCount < 1)
+        {
+            Fail("lookup returned a wrong or dead resource", id);
+        }
+        sched_yield();
+        if (resource->Id != id || resource->Key.Size != RESOURCE_MAGIC)
+        {
+            Fail("referenced resource was freed", id);
+        }
+
+        InterlockedIncrement64(&FoundCount);
+        PutResource(&TestContext, resource);
+    }
+
+    return NULL;
+}
+
+static VOID FreeTestEntryCallback(PEPOCH_ENTRY Entry, PVOID FreeContext)
+{
+    free(Entry);
+    InterlockedIncrement((volatile LONG*)FreeContext);
+}
+
+static PVOID SynchronizeRoutine(PVOID Parameter)
+{
+    ShimProcessorIndex = 1;
+    ShimIrql = PASSIVE_LEVEL;
+
+    EpochSynchronize();
+    InterlockedExchange((volatile LONG*)Parameter, TRUE);
+
+    return NULL;
+}
+
+// a reader inside its section holds back the synchronize and the reclaim of anything it could see
+static VOID TestEpochSection()
+{
+    KIRQL           outerIrql, innerIrql;
+    pthread_t       thread;
+    volatile LONG   freedCount = 0;
+    volatile LONG   bSynchronized = FALSE;
+
+    ShimProcessorIndex = 0;
+    EpochEnter(&outerIrql);
+    EpochEnter(&innerIrql);
+    EpochExit(innerIrql);
+
+    // the nested exit must not leave the outer section
+    EpochRetire(calloc(1, sizeof(EPOCH_ENTRY)), FreeTestEntryCallback, (PVOID)&freedCount);
+    EpochReclaim(FALSE);
+    if (freedCount != 0)
+    {
+        Fail("entry freed inside a read section", 0);
+    }
+
+    pthread_create(&thread, NULL, SynchronizeRoutine, (PVOID)&bSynchronized);
+    usleep(50000);
+    if (bSynchronized)
+    {
+        Fail("synchronize returned inside a read section", 0);
+    }
+
+    EpochExit(outerIrql);
+    pthread_join(thread, NULL);
+
+    EpochReclaim(TRUE);
+    if (freedCount != 1)
+    {
+        Fail("entry not freed after the read section", 0);
+    }
+}
+
+int main()
+{
+    pthread_t readers[NUM_READERS];
+    pthread_t writers[NUM_WRITERS];
+
+    ShimProcessorIndex = NUM_READERS + NUM_WRITERS;
+    ShimIrql = PASSIVE_LEVEL;
+
+    if (!NT_SUCCESS(InitializeEpoch()))
+    {
+        Fail("initialize epoch failed", 0);
+    }
+
+    TestEpochSection();
+
+    InitializeListHead(&TestContext.ResourceList);
+    KeInitializeSpinLock(&TestContext.ResourceListSpinLock);
+    TestContext.ResourceTable = AllocateResourceTable(RESOURCE_TABLE_MIN_SIZE);
+    TestContext.RefCount = 1;
+
+    for (ULONG i = 0; i < NUM_READERS; i++)
+    {
+        pthread_create(&readers[i], NULL, ReaderRoutine, (PVOID)(ULONG_PTR)i);
+    }
+    for (ULONG i = 0; i < NUM_WRITERS; i++)
+    {
+        pthread_create(&writers[i], NULL, WriterRoutine, (PVOID)(ULONG_PTR)(NUM_READERS + i));
+    }
+
+    for (ULONG i = 0; i < NUM_WRITERS; i++)
+    {
+        pthread_join(writers[i], NULL);
+    }
+    InterlockedExchange(&bWritersDone, TRUE);
+    for (ULONG i = 0; i < NUM_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    ShimProcessorIndex = NUM_READERS + NUM_WRITERS;
+    EpochSynchronize();
+    EpochReclaim(TRUE);
+
+    printf("table_test: created=%lld freed=%lld lookups=%lld found=%lld table=%u\n",
+        CreatedCount, FreedCount, LookupCount, FoundCount, TestContext.ResourceTable->Size);
+
+    if (TestContext.ResourceTableCount != 0 || !IsListEmpty(&TestContext.ResourceList))
+    {
+        Fail("table not empty", TestContext.ResourceTableCount);
+    }
+
+    if (CreatedCount != FreedCount)
+    {
+        Fail("resources leaked", (ULONG32)(CreatedCount - FreedCount));
+    }
+
+    ExFreePoolWithTag(TestContext.ResourceTable, VIRTIO_VGPU_MEMORY_TAG);
+    UninitializeEpoch();
+
+    return 0;
+}
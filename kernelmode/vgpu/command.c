@@ -18,10 +18,93 @@
 
 #include "global.h"
 #include "command.h"
+#include "control.h"
 
-#define COMMAND_QUEUE 0
-#define CONTROL_QUEUE 1
 
+VOID DrainQueue(PDEVICE_CONTEXT Context, ULONG32 QueueIndex)
+{
+    int                 ret = 0;
+    UINT32              count;
+    BOOLEAN             bNotify;
+    PSLIST_ENTRY        entry, staged;
+    PVGPU_BUFFER        buffer;
+    PVGPU_QUEUE_STAGE   stage = &Context->VirtQueueStages[QueueIndex];
+
+    // only one thread publishes to the ring, the others just leave their buffers staged
+    while (InterlockedCompareExchange(&stage->bDraining, TRUE, FALSE) == FALSE)
+    {
+        // the queues are gone while the device is stopped, anything staged stays there
+        if (!Context->bQueuesReady)
+        {
+            InterlockedExchange(&stage->bDraining, FALSE);
+            break;
+        }
+
+        // the staging list is lifo, reverse it to keep the order of the producers
+        staged = NULL;
+        entry = InterlockedFlushSList(&stage->StageList);
+        while (entry)
+        {
+            PSLIST_ENTRY next = entry->Next;
+            entry->Next = staged;
+            staged = entry;
+            entry = next;
+        }
+
+        for (entry = staged; entry; entry = entry->Next)
+        {
+            buffer = CONTAINING_RECORD(entry, VGPU_BUFFER, StageEntry);
+            InsertTailList(&stage->PendingList, &buffer->Entry);
+        }
+
+        count = 0;
+        WdfSpinLockAcquire(Context->VirtQueueLocks[QueueIndex]);
+        while (!IsListEmpty(&stage->PendingList))
+        {
+            buffer = CONTAINING_RECORD(stage->PendingList.Flink, VGPU_BUFFER, Entry);
+            ret = virtqueue_add_buf(Context->VirtQueues[QueueIndex], buffer->Sg, buffer->OutNum, buffer->InNum, buffer, NULL, 0);
+            if (ret != 0)
+            {
+                // the ring is full, the rest would be published after some buffers were completed
+                break;
+            }
+
+            RemoveEntryListUnsafe(&buffer->Entry);
+            count++;
+        }
+
+        // notify once for the whole batch and only if the device is waiting for it
+        bNotify = count > 0 && virtqueue_kick_prepare(Context->VirtQueues[QueueIndex]);
+        WdfSpinLockRelease(Context->VirtQueueLocks[QueueIndex]);
+
+        if (bNotify)
+        {
+            virtqueue_notify(Context->VirtQueues[QueueIndex]);
+            InterlockedIncrement64(&Context->NotifyCount);
+        }
+
+        // the polling thread sleeps in interrupt mode until there is work again
+        if (count > 0 && Context->PollThread && !Context->bPollThreadActive)
+        {
+            KeSetEvent(&Context->PollThreadEvent, IO_NO_INCREMENT, FALSE);
+        }
+        InterlockedAdd64(&Context->CommandCount, count);
+
+        InterlockedExchange(&stage->bDraining, FALSE);
+
+        // check again for buffers staged by producers which lost the race above
+        if (ret != 0 || ExQueryDepthSList(&stage->StageList) == 0)
+        {
+            break;
+        }
+    }
+}
+
+// stage a command whose descriptors are already in the buffer, the caller drains the queue
+VOID StageQueue(PDEVICE_CONTEXT Context, ULONG32 QueueIndex, PVGPU_BUFFER Buffer)
+{
+    InterlockedPushEntrySList(&Context->VirtQueueStages[QueueIndex].StageList, &Buffer->StageEntry);
+}
 
 NTSTATUS PushQueue(PDEVICE_CONTEXT Context,
     ULONG32 QueueIndex,
@@ -32,21 +115,65 @@ NTSTATUS PushQueue(PDEVICE_CONTEXT Context,
     void* va_indirect,
     ULONGLONG phys_indirect)
 {
-    int ret;
-    WdfSpinLockAcquire(Context->VirtQueueLocks[QueueIndex]);
-    ret = virtqueue_add_buf(Context->VirtQueues[QueueIndex], sg, out_num, in_num, opaque, va_indirect, phys_indirect);
-    WdfSpinLockRelease(Context->VirtQueueLocks[QueueIndex]);
+    UNREFERENCED_PARAMETER(va_indirect);
+    UNREFERENCED_PARAMETER(phys_indirect);
+
+    PVGPU_BUFFER buffer = opaque;
+
+    // the buffer stays with the caller if the device is stopped, a full ring only delays it
+    if (!Context->bQueuesReady)
+    {
+        VGPU_DEBUG_LOG("queue not ready QueueIndex=%d", QueueIndex);
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    // keep the descriptors in the buffer, they may be published by another thread
+    ASSERT(out_num + in_num <= SGLIST_SIZE);
+    RtlCopyMemory(buffer->Sg, sg, (out_num + in_num) * sizeof(struct VirtIOBufferDescriptor));
+    buffer->OutNum = out_num;
+    buffer->InNum = in_num;
+
+    StageQueue(Context, QueueIndex, buffer);
+    DrainQueue(Context, QueueIndex);
+
+    return STATUS_SUCCESS;
+}
+
+// every queue except the control and transfer queues carries commands, the last
+// one is kept for batch contexts and the others are spread over the processors
+ULONG32 SelectCommandQueue(PDEVICE_CONTEXT Context, UINT8 Priority)
+{
+    ULONG32 slot, numSlots;
+    ULONG32 numQueues = Context->TransferQueueIndex != COMMAND_QUEUE ? Context->TransferQueueIndex : Context->NumVirtQueues;
 
-    if (ret == 0)
+    if (numQueues <= CONTROL_QUEUE + 1)
     {
-        virtqueue_kick(Context->VirtQueues[QueueIndex]);
-        return STATUS_SUCCESS;
+        return COMMAND_QUEUE;
     }
-    else
+
+    if (Priority == VIRTGPU_CONTEXT_PRIORITY_BATCH)
     {
-        VGPU_DEBUG_LOG("virtqueue_add_buf failed ret=%d QueueIndex=%d", ret, QueueIndex);
-        return STATUS_UNSUCCESSFUL;
+        return numQueues - 1;
     }
+
+    numSlots = numQueues - 2;
+    slot = KeGetCurrentProcessorNumberEx(NULL) % numSlots;
+    return slot == 0 ? COMMAND_QUEUE : slot + CONTROL_QUEUE;
+}
+
+// commands of a context stay on the queue of its submissions to keep them in order
+ULONG32 GetCommandQueueIndex(ULONG32 VirglContextId)
+{
+    KIRQL           oldIrql;
+    ULONG32         queueIndex;
+    PVIRGL_CONTEXT  virglContext;
+
+    EpochEnter(&oldIrql);
+    virglContext = GetVirglContextFromListUnsafe(VirglContextId);
+    queueIndex = virglContext ? virglContext->QueueIndex : COMMAND_QUEUE;
+    EpochExit(oldIrql);
+
+    return queueIndex;
 }
 
 PVGPU_BUFFER AllocateCommandBuffer(PDEVICE_CONTEXT Context, size_t CmdSize, size_t RespSize, BOOLEAN bSync, WDFREQUEST Request)
@@ -213,15 +340,20 @@ VOID TransferToHost2D(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_
 
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    PushQueue(Context, GetCommandQueueIndex(VirglContextId), sg, outNum, 0, buffer, NULL, 0);
 }
 
-VOID TransferHost3D(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TRANSFER_HOST_3D_PARAM Transfer, ULONG64 FenceId, BOOLEAN ToHost)
+// the transfer is queued behind the submissions of its context, see PushTransferCommand
+PVGPU_BUFFER AllocateTransferCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TRANSFER_HOST_3D_PARAM Transfer, ULONG64 FenceId, BOOLEAN ToHost)
 {
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
-    UINT32 outNum;
-
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_transfer_host_3d), 0, FALSE, NULL);
+    buffer->ResourceIds = NULL;
+    buffer->ResourceIdsCount = 0;
+    buffer->pDataBuf = NULL;
+    buffer->DataBufSize = 0;
+    buffer->FenceObject = NULL;
+    buffer->InFenceObject = NULL;
+
     struct virtio_gpu_transfer_host_3d* cmd = buffer->pBuf;
 
     cmd->hdr.type = ToHost ? VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D : VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D;
@@ -246,9 +378,29 @@ VOID TransferHost3D(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TR
         cmd->hdr.fence_id = FenceId;
     }
 
+    return buffer;
+}
+
+NTSTATUS PushTransferCommand(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer)
+{
+    UINT32 outNum;
+    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
+    struct virtio_gpu_transfer_host_3d* cmd = Buffer->pBuf;
+
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    // big uploads on their own queue don't hold up the draws behind them in the host
+    if (Context->TransferQueueIndex != COMMAND_QUEUE)
+    {
+        return PushQueue(Context, Context->TransferQueueIndex, sg, outNum, 0, Buffer, NULL, 0);
+    }
+
+    return PushQueue(Context, GetCommandQueueIndex(cmd->hdr.ctx_id), sg, outNum, 0, Buffer, NULL, 0);
+}
+
+VOID TransferHost3D(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TRANSFER_HOST_3D_PARAM Transfer, ULONG64 FenceId, BOOLEAN ToHost)
+{
+    PushTransferCommand(Context, AllocateTransferCommand(Context, VirglContextId, Transfer, FenceId, ToHost));
 }
 
 VOID Create2DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId)
@@ -275,14 +427,11 @@ VOID Create2DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 R
 
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    PushQueue(Context, GetCommandQueueIndex(VirglContextId), sg, outNum, 0, buffer, NULL, 0);
 }
 
-VOID Create3DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId)
+PVGPU_BUFFER BuildCreate3DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId)
 {
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
-    UINT32 outNum;
-
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_resource_create_3d), 0, FALSE, NULL);
     struct virtio_gpu_resource_create_3d* cmd = buffer->pBuf;
 
@@ -307,9 +456,56 @@ VOID Create3DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 R
         cmd->hdr.fence_id = FenceId;
     }
 
-    outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->OutNum = BuildSGElement(buffer->Sg, SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->InNum = 0;
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    return buffer;
+}
+
+VOID Create3DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId)
+{
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    StageQueue(Context, queueIndex, BuildCreate3DResource(Context, VirglContextId, ResourceId, Create, FenceId));
+    DrainQueue(Context, queueIndex);
+}
+
+PVGPU_BUFFER BuildCreate3DResourceWithBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource, PVIRTGPU_RESOURCE_CREATE_PARAM Create)
+{
+    PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_resource_create_3d_with_backing), 0, FALSE, NULL);
+    struct virtio_gpu_resource_create_3d_with_backing* cmd = buffer->pBuf;
+
+    cmd->create.hdr.type = VIRTIO_GPU_CMD_RESOURCE_CREATE_3D_WITH_BACKING;
+    cmd->create.hdr.ctx_id = VirglContextId;
+    cmd->create.resource_id = Resource->Id;
+
+    cmd->create.format = Create->format;
+    cmd->create.width = Create->width;
+    cmd->create.height = Create->height;
+    cmd->create.target = Create->target;
+    cmd->create.bind = Create->bind;
+    cmd->create.depth = Create->depth;
+    cmd->create.array_size = Create->array_size;
+    cmd->create.last_level = Create->last_level;
+    cmd->create.nr_samples = Create->nr_samples;
+    cmd->create.flags = Create->flags;
+
+    // resource use contiguous physical memory from vgpu memory
+    cmd->gpa = Resource->Buffer.Memory.PhysicalAddress.QuadPart;
+    cmd->size = (ULONG32)Resource->Buffer.Size;
+
+    buffer->OutNum = BuildSGElement(buffer->Sg, SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->InNum = 0;
+
+    return buffer;
+}
+
+VOID Create3DResourceWithBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource, PVIRTGPU_RESOURCE_CREATE_PARAM Create)
+{
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    StageQueue(Context, queueIndex, BuildCreate3DResourceWithBacking(Context, VirglContextId, Resource, Create));
+    DrainQueue(Context, queueIndex);
 }
 
 VOID CreateBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_BLOB_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId)
@@ -349,7 +545,7 @@ VOID CreateBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32
 
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    PushQueue(Context, GetCommandQueueIndex(VirglContextId), sg, outNum, 0, buffer, NULL, 0);
 }
 
 VOID MapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, ULONG64 FenceId)
@@ -374,14 +570,11 @@ VOID MapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 Re
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
     inNum = BuildSGElement(&sg[outNum], SGLIST_SIZE - outNum, (PUINT8)resp, sizeof(*resp));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, inNum, buffer, NULL, 0);
+    PushQueue(Context, GetCommandQueueIndex(VirglContextId), sg, outNum, inNum, buffer, NULL, 0);
 }
 
-VOID UnMapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, ULONG64 FenceId)
+PVGPU_BUFFER BuildUnMapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, ULONG64 FenceId)
 {
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
-    UINT32 outNum;
-
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_resource_unmap_blob), 0, FALSE, NULL);
     struct virtio_gpu_resource_unmap_blob* cmd = buffer->pBuf;
 
@@ -395,16 +588,22 @@ VOID UnMapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32
         cmd->hdr.fence_id = FenceId;
     }
 
-    outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->OutNum = BuildSGElement(buffer->Sg, SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->InNum = 0;
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    return buffer;
 }
 
-VOID AttachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource)
+VOID UnMapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, ULONG64 FenceId)
 {
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
-    UINT32 outNum;
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
 
+    StageQueue(Context, queueIndex, BuildUnMapBlobResource(Context, VirglContextId, ResourceId, FenceId));
+    DrainQueue(Context, queueIndex);
+}
+
+PVGPU_BUFFER BuildAttachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource)
+{
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_resource_attach_backing), 0, FALSE, NULL);
     struct virtio_gpu_resource_attach_backing* cmd = buffer->pBuf;
 
@@ -416,25 +615,66 @@ VOID AttachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIR
     cmd->gpa = Resource->Buffer.Memory.PhysicalAddress.QuadPart;
     cmd->size = (ULONG32)Resource->Buffer.Size;
 
-    outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->OutNum = BuildSGElement(buffer->Sg, SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->InNum = 0;
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    return buffer;
 }
 
-VOID DetachResourceBacking(PDEVICE_CONTEXT Context, PVIRGL_RESOURCE Resource)
+VOID AttachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource)
 {
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
-    UINT32 outNum;
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    StageQueue(Context, queueIndex, BuildAttachResourceBacking(Context, VirglContextId, Resource));
+    DrainQueue(Context, queueIndex);
+}
 
+// the commands creating a batch of resources are published and kicked together
+VOID CreateResources(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE* Resources, PVIRTGPU_RESOURCE_CREATE_PARAM Creates, ULONG Count)
+{
+    ULONG   index;
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    for (index = 0; index < Count; index++)
+    {
+        if (Resources[index]->bForBuffer && (Context->Capabilities & VIRTIO_VGPU_CAP_CREATE_WITH_BACKING))
+        {
+            StageQueue(Context, queueIndex, BuildCreate3DResourceWithBacking(Context, VirglContextId, Resources[index], &Creates[index]));
+        }
+        else
+        {
+            StageQueue(Context, queueIndex, BuildCreate3DResource(Context, VirglContextId, Resources[index]->Id, &Creates[index], 0));
+            if (Resources[index]->bForBuffer)
+            {
+                StageQueue(Context, queueIndex, BuildAttachResourceBacking(Context, VirglContextId, Resources[index]));
+            }
+        }
+    }
+
+    DrainQueue(Context, queueIndex);
+}
+
+PVGPU_BUFFER BuildDetachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource)
+{
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_resource_detach_backing), 0, FALSE, NULL);
     struct virtio_gpu_resource_detach_backing* cmd = buffer->pBuf;
 
     cmd->hdr.type = VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING;
+    cmd->hdr.ctx_id = VirglContextId;
     cmd->resource_id = Resource->Id;
 
-    outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->OutNum = BuildSGElement(buffer->Sg, SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->InNum = 0;
+
+    return buffer;
+}
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+VOID DetachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource)
+{
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    StageQueue(Context, queueIndex, BuildDetachResourceBacking(Context, VirglContextId, Resource));
+    DrainQueue(Context, queueIndex);
 }
 
 VOID AttachResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId)
@@ -451,7 +691,7 @@ VOID AttachResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 Res
 
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    PushQueue(Context, GetCommandQueueIndex(VirglContextId), sg, outNum, 0, buffer, NULL, 0);
 }
 
 VOID DetachResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId)
@@ -468,14 +708,11 @@ VOID DetachResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 Res
 
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    PushQueue(Context, GetCommandQueueIndex(VirglContextId), sg, outNum, 0, buffer, NULL, 0);
 }
 
-VOID UnrefResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId)
+PVGPU_BUFFER BuildUnrefResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId)
 {
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
-    UINT32 outNum;
-
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_resource_unref), 0, FALSE, NULL);
     struct virtio_gpu_resource_unref* cmd = buffer->pBuf;
 
@@ -483,23 +720,58 @@ VOID UnrefResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 Reso
     cmd->hdr.ctx_id = VirglContextId;
     cmd->resource_id = ResourceId;
 
-    outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->OutNum = BuildSGElement(buffer->Sg, SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
+    buffer->InNum = 0;
 
-    PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    return buffer;
 }
 
-NTSTATUS SubmitCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PMEMORY_DESCRIPTOR Command, SIZE_T CommandBufSize, SIZE_T CommandSize,
-    PVOID ResourceIds, SIZE_T ResourceIdsCount, ULONG64 FenceId, PVOID FenceObject)
+VOID UnrefResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId)
 {
-    UINT32 outNum;
-    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
+    ULONG32 queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    StageQueue(Context, queueIndex, BuildUnrefResource(Context, VirglContextId, ResourceId));
+    DrainQueue(Context, queueIndex);
+}
 
+// the commands destroying a list of resources linked by their entries are published and kicked together
+VOID DestroyResources(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PLIST_ENTRY Resources)
+{
+    PLIST_ENTRY     item;
+    PVIRGL_RESOURCE resource;
+    ULONG32         queueIndex = GetCommandQueueIndex(VirglContextId);
+
+    for (item = Resources->Flink; item != Resources; item = item->Flink)
+    {
+        resource = CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry);
+        if (resource->bForBuffer)
+        {
+            if (resource->bForBlob)
+            {
+                StageQueue(Context, queueIndex, BuildUnMapBlobResource(Context, VirglContextId, resource->Id, 0));
+            }
+            else
+            {
+                StageQueue(Context, queueIndex, BuildDetachResourceBacking(Context, VirglContextId, resource));
+            }
+        }
+        StageQueue(Context, queueIndex, BuildUnrefResource(Context, VirglContextId, resource->Id));
+    }
+
+    DrainQueue(Context, queueIndex);
+}
+
+PVGPU_BUFFER AllocateSubmitCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PMEMORY_DESCRIPTOR Command, SIZE_T CommandBufSize, SIZE_T CommandSize,
+    PVOID ResourceIds, SIZE_T ResourceIdsCount, ULONG64 FenceId, PVOID FenceObject, PVOID InFenceObject)
+{
     PVGPU_BUFFER buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_cmd_submit), 0, FALSE, NULL);
     buffer->ResourceIds = ResourceIds;
     buffer->ResourceIdsCount = ResourceIdsCount;
     buffer->pDataBuf = Command->VirtualAddress;
+    buffer->DataBufPhysicalAddress = Command->PhysicalAddress;
     buffer->DataBufSize = CommandBufSize;
     buffer->FenceObject = FenceObject;
+    buffer->InFenceObject = InFenceObject;
 
     struct virtio_gpu_cmd_submit* cmd = buffer->pBuf;
     cmd->hdr.ctx_id = VirglContextId;
@@ -512,11 +784,26 @@ NTSTATUS SubmitCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PMEMORY_
         cmd->hdr.fence_id = FenceId;
     }
 
+    return buffer;
+}
+
+NTSTATUS PushSubmitCommand(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer)
+{
+    NTSTATUS status;
+    UINT32 outNum;
+    struct VirtIOBufferDescriptor sg[SGLIST_SIZE];
+    struct virtio_gpu_cmd_submit* cmd = Buffer->pBuf;
+
     // cmd buffer use contiguous physical memory from vgpu memory
     outNum = BuildSGElement(&sg[0], SGLIST_SIZE, (PUINT8)cmd, sizeof(*cmd));
-    sg[outNum].physAddr = Command->PhysicalAddress;
-    sg[outNum].length = (ULONG32)CommandSize;
+    sg[outNum].physAddr = Buffer->DataBufPhysicalAddress;
+    sg[outNum].length = cmd->size;
     outNum++;
 
-    return PushQueue(Context, COMMAND_QUEUE, sg, outNum, 0, buffer, NULL, 0);
+    status = PushQueue(Context, GetCommandQueueIndex(cmd->hdr.ctx_id), sg, outNum, 0, Buffer, NULL, 0);
+    if (NT_SUCCESS(status))
+    {
+        InterlockedIncrement64(&Context->Submit3DCount);
+    }
+    return status;
 }
\ No newline at end of file
@@ -23,6 +23,9 @@
 
 #define VIRTIO_GPU_FLAG_FENCE (1 << 0)
 
+#define COMMAND_QUEUE   0
+#define CONTROL_QUEUE   1
+
 enum virtio_gpu_ctrl_type {
     VIRTIO_GPU_UNDEFINED = 0,
 
@@ -54,6 +57,9 @@ enum virtio_gpu_ctrl_type {
     VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB,
     VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB,
 
+    /* mvisor vgpu commands */
+    VIRTIO_GPU_CMD_RESOURCE_CREATE_3D_WITH_BACKING = 0x0280,
+
     /* cursor commands */
     VIRTIO_GPU_CMD_UPDATE_CURSOR = 0x0300,
     VIRTIO_GPU_CMD_MOVE_CURSOR,
@@ -149,6 +155,14 @@ struct virtio_gpu_resource_attach_backing {
     __le32 size;
 };
 
+/* VIRTIO_GPU_CMD_RESOURCE_CREATE_3D_WITH_BACKING: create a 3d resource and attach its backing */
+struct virtio_gpu_resource_create_3d_with_backing {
+    struct virtio_gpu_resource_create_3d create;
+    __le64 gpa;
+    __le32 size;
+    __le32 padding;
+};
+
 /* VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING */
 struct virtio_gpu_resource_detach_backing {
     struct virtio_gpu_ctrl_hdr hdr;
@@ -348,21 +362,31 @@ FORCEINLINE VOID FreeCommandBuffer(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer)
     ExFreeToLookasideListEx(&Context->VgpuBufferLookAsideList, Buffer);
 }
 
+PVGPU_BUFFER AllocateCommandBuffer(PDEVICE_CONTEXT Context, size_t CmdSize, size_t RespSize, BOOLEAN bSync, WDFREQUEST Request);
+VOID DrainQueue(PDEVICE_CONTEXT Context, ULONG32 QueueIndex);
+VOID StageQueue(PDEVICE_CONTEXT Context, ULONG32 QueueIndex, PVGPU_BUFFER Buffer);
+ULONG32 SelectCommandQueue(PDEVICE_CONTEXT Context, UINT8 Priority);
 VOID GetCapsInfo(PDEVICE_CONTEXT Context);
 VOID GetCaps(PDEVICE_CONTEXT Context, INT32 CapsIndex, UINT32 CapsVer, PVOID pCaps);
 VOID CreateVirglContext(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ContextInit);
 VOID DestroyVirglContext(PDEVICE_CONTEXT Context, ULONG32 VirglContextId);
 VOID Create2DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId);
 VOID Create3DResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId);
+VOID Create3DResourceWithBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource, PVIRTGPU_RESOURCE_CREATE_PARAM Create);
 VOID CreateBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, PVIRTGPU_BLOB_RESOURCE_CREATE_PARAM Create, ULONG64 FenceId);
 VOID MapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, ULONG64 FenceId);
 VOID UnMapBlobResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId, ULONG64 FenceId);
 VOID AttachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource);
-VOID DetachResourceBacking(PDEVICE_CONTEXT Context, PVIRGL_RESOURCE Resource);
+VOID CreateResources(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE* Resources, PVIRTGPU_RESOURCE_CREATE_PARAM Creates, ULONG Count);
+VOID DetachResourceBacking(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRGL_RESOURCE Resource);
 VOID AttachResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId);
 VOID DetachResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId);
 VOID UnrefResource(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, ULONG32 ResourceId);
+VOID DestroyResources(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PLIST_ENTRY Resources);
 VOID TransferToHost2D(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TRANSFER_HOST_2D_PARAM Transfer);
 VOID TransferHost3D(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TRANSFER_HOST_3D_PARAM Transfer, ULONG64 FenceId, BOOLEAN ToHost);
-NTSTATUS SubmitCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PMEMORY_DESCRIPTOR Command, SIZE_T CommandBufSize, SIZE_T CommandSize,
-    PVOID ResourceIds, SIZE_T ResourceIdsCount, ULONG64 FenceId, PVOID FenceObject);
\ No newline at end of file
+PVGPU_BUFFER AllocateSubmitCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PMEMORY_DESCRIPTOR Command, SIZE_T CommandBufSize, SIZE_T CommandSize,
+    PVOID ResourceIds, SIZE_T ResourceIdsCount, ULONG64 FenceId, PVOID FenceObject, PVOID InFenceObject);
+NTSTATUS PushSubmitCommand(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer);
+PVGPU_BUFFER AllocateTransferCommand(PDEVICE_CONTEXT Context, ULONG32 VirglContextId, PVIRTGPU_TRANSFER_HOST_3D_PARAM Transfer, ULONG64 FenceId, BOOLEAN ToHost);
+NTSTATUS PushTransferCommand(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer);
\ No newline at end of file
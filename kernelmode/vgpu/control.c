@@ -18,55 +18,87 @@
 
 #include "global.h"
 #include "control.h"
+#include "table.h"
 #include "command.h"
 #include "memory.h"
 #include "idr.h"
+#include "submit.h"
+#include "worker.h"
 
 
-PVIRGL_CONTEXT GetVirglContextFromList(ULONG32 VirglContextId)
+VOID FreeResourceCallback(PEPOCH_ENTRY Entry, PVOID FreeContext)
 {
-    KIRQL           savedIrql;
-    PVIRGL_CONTEXT  virglContext;
-
-    SpinLock(&savedIrql, &VirglContextListSpinLock);
-    virglContext = GetVirglContextFromListUnsafe(VirglContextId);
-    SpinUnLock(savedIrql, &VirglContextListSpinLock);
-
-    return virglContext;
+    ExFreeToLookasideListEx(&((PDEVICE_CONTEXT)FreeContext)->VirglResourceLookAsideList, CONTAINING_RECORD(Entry, VIRGL_RESOURCE, RetireEntry));
 }
 
-PVIRGL_RESOURCE GetResourceFromList(PVIRGL_CONTEXT VirglContext, ULONG32 Id)
+// the worker holds a reference on the resource, a closed blob needs its mapping as well to be reclaimed
+VOID MapBlobResourceCallback(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource, ULONG64 Gpa, SIZE_T Size, ULONG32 MapInfo)
 {
-    KIRQL           savedIrql;
-    PVIRGL_RESOURCE resource;
+    PHYSICAL_ADDRESS    phyaddr;
+    PVOID               mapAddress;
+    ULONG               protect;
+    MEMORY_CACHING_TYPE cacheType;
 
-    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
-    resource = GetResourceFromListUnsafe(VirglContext, Id);
-    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+    UNREFERENCED_PARAMETER(VirglContext);
 
-    return resource;
+    // the kernel and the user mapping must use the cache type of the host mapping
+    switch (MapInfo & VIRTIO_GPU_MAP_CACHE_MASK)
+    {
+    case VIRTIO_GPU_MAP_CACHE_CACHED:
+        protect = PAGE_READWRITE;
+        cacheType = MmCached;
+        break;
+    case VIRTIO_GPU_MAP_CACHE_WC:
+        protect = PAGE_READWRITE | PAGE_WRITECOMBINE;
+        cacheType = MmWriteCombined;
+        break;
+    default:
+        protect = PAGE_READWRITE | PAGE_NOCACHE;
+        cacheType = MmNonCached;
+        break;
+    }
+
+    phyaddr.QuadPart = Gpa;
+    mapAddress = MmMapIoSpaceEx(phyaddr, Size, protect);
+    if (mapAddress)
+    {
+        Resource->Buffer.Size = Size;
+        Resource->Buffer.Memory.VirtualAddress = mapAddress;
+        Resource->Buffer.Share.CacheType = cacheType;
+        VGPU_DEBUG_LOG("map blob resource id=%d map_info=0x%x", Resource->Id, MapInfo);
+    }
+    else
+    {
+        VGPU_DEBUG_LOG("mapAddress failed Gpa=0x%llx", Gpa);
+    }
+
+    // the map was the pending command of the blob, a failed one leaves it without kernel address
+    SetResourceState(Resource, FALSE);
 }
 
-VOID MapBlobResourceCallback(PVIRGL_CONTEXT VirglContext, ULONG32 Id, ULONG64 Gpa, SIZE_T Size)
+// the waiters of many resources are woken at passive level, each resource is referenced while its event is set
+VOID UpdateResourceStatePassive(PVIRGL_CONTEXT VirglContext, PULONG32 ResourceIds, SIZE_T ResourceIdsCount, BOOLEAN Busy)
 {
-    PHYSICAL_ADDRESS    phyaddr;
-    PVIRGL_RESOURCE     resource;
-    PVOID               mapAddress;
+    KIRQL           oldIrql;
+    SIZE_T          index;
+    PVIRGL_RESOURCE resource;
 
-    resource = GetResourceFromListUnsafe(VirglContext, Id);
-    if (resource)
+    for (index = 0; index < ResourceIdsCount; index++)
     {
-        phyaddr.QuadPart = Gpa;
-        mapAddress = MmMapIoSpaceEx(phyaddr, Size, PAGE_READWRITE | PAGE_NOCACHE);
-        if (!mapAddress)
+        // a closed resource still follows its fences until it is reclaimed
+        EpochEnter(&oldIrql);
+        resource = GetResourceFromListUnsafe(VirglContext, ResourceIds[index]);
+        if (resource && !EpochTryReference(&resource->RefCount))
         {
-            VGPU_DEBUG_LOG("mapAddress failed Gpa=0x%llx", Gpa);
-            return;
+            resource = NULL;
         }
+        EpochExit(oldIrql);
 
-        resource->Buffer.Size = Size;
-        resource->Buffer.Memory.VirtualAddress = mapAddress;
-        KeSetEvent(&resource->StateEvent, 0, FALSE);
+        if (resource)
+        {
+            SetResourceState(resource, Busy);
+            PutResource(VirglContext, resource);
+        }
     }
 }
 
@@ -88,7 +120,7 @@ BOOLEAN CreateUserShareMemory(PSHARE_DESCRIPTOR ShareMemory)
     MmBuildMdlForNonPagedPool(ShareMemory->pMdl);
 
     try {
-        ShareMemory->UserAdderss = MmMapLockedPagesSpecifyCache(ShareMemory->pMdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+        ShareMemory->UserAdderss = MmMapLockedPagesSpecifyCache(ShareMemory->pMdl, UserMode, ShareMemory->CacheType, NULL, FALSE, NormalPagePriority);
     } except(EXCEPTION_EXECUTE_HANDLER) {
         IoFreeMdl(ShareMemory->pMdl);
         VGPU_DEBUG_PRINT("except: create share memory with user failed");
@@ -116,31 +148,207 @@ VOID DeleteUserShareMemory(PSHARE_DESCRIPTOR ShareMemory)
     IoFreeMdl(ShareMemory->pMdl);
 }
 
-VOID DeleteResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+// the host commands of all resources on the list go out with one kick
+VOID DeleteResources(PVIRGL_CONTEXT VirglContext, PLIST_ENTRY Resources)
 {
-    if (Resource->bForBuffer)
+    PVIRGL_RESOURCE resource;
+
+    if (IsListEmpty(Resources))
+    {
+        return;
+    }
+
+    DestroyResources(VirglContext->DeviceContext, VirglContext->Id, Resources);
+
+    while (!IsListEmpty(Resources))
+    {
+        resource = CONTAINING_RECORD(RemoveHeadList(Resources), VIRGL_RESOURCE, Entry);
+        if (resource->bForBuffer)
+        {
+            if (resource->Buffer.Share.pMdl)
+            {
+                DeleteUserShareMemory(&resource->Buffer.Share);
+            }
+
+            if (resource->bForBlob)
+            {
+                // the map may have failed or never completed
+                if (resource->Buffer.Memory.VirtualAddress)
+                {
+                    MmUnmapIoSpace(resource->Buffer.Memory.VirtualAddress, resource->Buffer.Size);
+                }
+            }
+            else
+            {
+                FreeVgpuMemory(resource->Buffer.Memory.VirtualAddress, resource->Buffer.Size);
+            }
+        }
+
+        EpochRetire(&resource->RetireEntry, FreeResourceCallback, VirglContext->DeviceContext);
+    }
+}
+
+// the last reference deletes the resource, it was taken off the table and the lists before
+VOID PutResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+{
+    LIST_ENTRY deleteList;
+
+    if (InterlockedDecrement(&Resource->RefCount) == 0)
+    {
+        InitializeListHead(&deleteList);
+        InsertTailList(&deleteList, &Resource->Entry);
+        DeleteResources(VirglContext, &deleteList);
+    }
+}
+
+VOID ReclaimRetiredResources(PVIRGL_CONTEXT VirglContext, BOOLEAN All)
+{
+    KIRQL           savedIrql;
+    LIST_ENTRY      reclaimList;
+    PLIST_ENTRY     item, next;
+    PVIRGL_RESOURCE resource;
+
+    InitializeListHead(&reclaimList);
+
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+    for (item = VirglContext->RetireList.Flink; item != &VirglContext->RetireList; item = next)
     {
-        if (Resource->Buffer.Share.pMdl)
+        next = item->Flink;
+        resource = CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry);
+
+        // the host is done with the resource once no command referencing it is pending
+        if (All || resource->InFlightCount == 0)
         {
-            DeleteUserShareMemory(&Resource->Buffer.Share);
+            // an ioctl still holding the resource deletes it when it drops the last reference
+            RemoveResourceUnsafe(VirglContext, resource);
+            VirglContext->RetireCount--;
+            if (InterlockedDecrement(&resource->RefCount) == 0)
+            {
+                InsertTailList(&reclaimList, &resource->Entry);
+            }
         }
+    }
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
 
-        if (Resource->bForBlob)
+    DeleteResources(VirglContext, &reclaimList);
+}
+
+// park a closed resource until the host completed its last fence
+VOID RetireResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+{
+    KIRQL   savedIrql;
+    BOOLEAN bReclaim;
+
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+    Resource->bClosed = TRUE;
+    RemoveEntryListUnsafe(&Resource->Entry);
+    InsertTailList(&VirglContext->RetireList, &Resource->Entry);
+    bReclaim = ++VirglContext->RetireCount >= RESOURCE_RETIRE_BATCH;
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+
+    if (bReclaim)
+    {
+        ReclaimRetiredResources(VirglContext, FALSE);
+    }
+}
+
+PVIRGL_RESOURCE TakeCachedResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE_KEY Key)
+{
+    KIRQL           savedIrql;
+    PLIST_ENTRY     item;
+    PVIRGL_RESOURCE resource = NULL;
+
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+    for (item = VirglContext->ResourceCache.Flink; item != &VirglContext->ResourceCache; item = item->Flink)
+    {
+        if (RtlEqualMemory(&CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry)->Key, Key, sizeof(VIRGL_RESOURCE_KEY)))
         {
-            UnMapBlobResource(VirglContext->DeviceContext, VirglContext->Id, Resource->Id, 0);
-            MmUnmapIoSpace(Resource->Buffer.Memory.VirtualAddress, Resource->Buffer.Size);
+            resource = CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry);
+            RemoveEntryListUnsafe(&resource->Entry);
+            VirglContext->ResourceCacheSize -= resource->Buffer.Size;
+            resource->bClosed = FALSE;
+            break;
         }
-        else
+    }
+
+    if (resource)
+    {
+        VirglContext->ResourceCacheHits++;
+    }
+    else
+    {
+        VirglContext->ResourceCacheMisses++;
+    }
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+
+    return resource;
+}
+
+BOOLEAN IsResourceCacheable(PVIRGL_RESOURCE Resource)
+{
+    // only buffers backed by the pool and no longer used by any pending host command can be handed out again
+    return Resource->bForBuffer && !Resource->bForBlob && Resource->Buffer.Size <= RESOURCE_CACHE_MAX_SIZE &&
+        Resource->InFlightCount == 0;
+}
+
+BOOLEAN PutResourceToCache(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+{
+    KIRQL savedIrql;
+
+    if (!IsResourceCacheable(Resource))
+    {
+        return FALSE;
+    }
+
+    if (Resource->Buffer.Share.pMdl)
+    {
+        DeleteUserShareMemory(&Resource->Buffer.Share);
+        Resource->Buffer.Share.pMdl = NULL;
+    }
+
+    Resource->CachedTime = KeQueryInterruptTime();
+
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+    InsertHeadList(&VirglContext->ResourceCache, &Resource->Entry);
+    VirglContext->ResourceCacheSize += Resource->Buffer.Size;
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+
+    return TRUE;
+}
+
+VOID TrimResourceCache(PVIRGL_CONTEXT VirglContext, BOOLEAN All)
+{
+    KIRQL           savedIrql;
+    LIST_ENTRY      trimList;
+    PVIRGL_RESOURCE resource;
+    ULONG64         now = KeQueryInterruptTime();
+
+    InitializeListHead(&trimList);
+
+    // the oldest resources are at the tail, drop them while they are too old or the cache is too big
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+    while (!IsListEmpty(&VirglContext->ResourceCache))
+    {
+        resource = CONTAINING_RECORD(VirglContext->ResourceCache.Blink, VIRGL_RESOURCE, Entry);
+        if (!All && VirglContext->ResourceCacheSize <= RESOURCE_CACHE_MAX_SIZE &&
+            now - resource->CachedTime < RESOURCE_CACHE_MAX_AGE_MS * 10000ULL)
+        {
+            break;
+        }
+
+        RemoveEntryListUnsafe(&resource->Entry);
+        VirglContext->ResourceCacheSize -= resource->Buffer.Size;
+        if (InterlockedDecrement(&resource->RefCount) == 0)
         {
-            DetachResourceBacking(VirglContext->DeviceContext, Resource);
-            FreeVgpuMemory(Resource->Buffer.Memory.VirtualAddress, Resource->Buffer.Size);
+            InsertTailList(&trimList, &resource->Entry);
         }
     }
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
 
-    UnrefResource(VirglContext->DeviceContext, VirglContext->Id, Resource->Id);
+    DeleteResources(VirglContext, &trimList);
 }
 
-NTSTATUS CtlGetParams(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+NTSTATUS CtlGetParams(IN PDEVICE_CONTEXT Context, IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS status = STATUS_UNSUCCESSFUL;
     ULONG64* input = NULL, * output = NULL;
@@ -179,13 +387,107 @@ NTSTATUS CtlGetParams(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size
 
     switch (*input)
     {
-    case 0x1000:
+    case VIRTGPU_PARAM_STAGING:
         // get vgpu staging config
         VirtIOWdfDeviceGet(&Context->VDevice, FIELD_OFFSET(struct virtio_vgpu_config, staging), output, sizeof(UINT8));
         break;
+    case VIRTGPU_PARAM_EXECBUFFER_COUNT:
+        *output = Context->ExecbufferCount;
+        break;
+    case VIRTGPU_PARAM_SUBMIT_3D_COUNT:
+        // execbuffer count divided by this one is the merge ratio of the coalescing
+        *output = Context->Submit3DCount;
+        break;
+    case VIRTGPU_PARAM_COMMAND_COUNT:
+        *output = Context->CommandCount;
+        break;
+    case VIRTGPU_PARAM_NOTIFY_COUNT:
+        *output = Context->NotifyCount;
+        break;
+    case VIRTGPU_PARAM_INTERRUPT_COUNT:
+        *output = Context->InterruptCount;
+        break;
+    case VIRTGPU_PARAM_COMPLETION_COUNT:
+        *output = Context->CompletionCount;
+        break;
+    case VIRTGPU_PARAM_COMPLETION_TIME:
+        *output = Context->CompletionTime;
+        break;
+    case VIRTGPU_PARAM_SUBMIT_LATENCY_P50:
+    case VIRTGPU_PARAM_SUBMIT_LATENCY_P90:
+    case VIRTGPU_PARAM_SUBMIT_LATENCY_P99:
+        if (VirglContext)
+        {
+            *output = GetSubmitLatencyPercentile(VirglContext, *input == VIRTGPU_PARAM_SUBMIT_LATENCY_P50 ? 50 :
+                *input == VIRTGPU_PARAM_SUBMIT_LATENCY_P90 ? 90 : 99);
+        }
+        else
+        {
+            *output = 0;
+        }
+        break;
+    case VIRTGPU_PARAM_POLL_THREAD_TIME:
+        *output = Context->PollThreadTime;
+        break;
+    case VIRTGPU_PARAM_POLL_THREAD_BUSY_TIME:
+        // divided by the time above it is the utilization of the polling thread
+        *output = Context->PollThreadBusyTime;
+        break;
+    case VIRTGPU_PARAM_RESOURCE_CACHE_HITS:
+    case VIRTGPU_PARAM_RESOURCE_CACHE_MISSES:
+        if (VirglContext)
+        {
+            *output = *input == VIRTGPU_PARAM_RESOURCE_CACHE_HITS ? VirglContext->ResourceCacheHits : VirglContext->ResourceCacheMisses;
+        }
+        else
+        {
+            *output = 0;
+        }
+        break;
+    case VIRTGPU_PARAM_WAIT_SPIN_HITS:
+    case VIRTGPU_PARAM_WAIT_SPIN_MISSES:
+        if (VirglContext)
+        {
+            *output = *input == VIRTGPU_PARAM_WAIT_SPIN_HITS ? VirglContext->WaitSpinHits : VirglContext->WaitSpinMisses;
+        }
+        else
+        {
+            *output = 0;
+        }
+        break;
     case VIRTGPU_PARAM_SUPPORTED_CAPSET_IDs:
         *output = Capsets.CapsetIdMask;
         break;
+    case VIRTGPU_PARAM_QUEUE_INTERRUPT_COUNT:
+    case VIRTGPU_PARAM_QUEUE_INTERRUPT_COUNT + 1:
+    case VIRTGPU_PARAM_QUEUE_INTERRUPT_COUNT + 2:
+    case VIRTGPU_PARAM_QUEUE_INTERRUPT_COUNT + 3:
+        *output = Context->QueueInterruptCount[*input - VIRTGPU_PARAM_QUEUE_INTERRUPT_COUNT];
+        break;
+    case VIRTGPU_PARAM_QUEUE_DPC_COUNT:
+    case VIRTGPU_PARAM_QUEUE_DPC_COUNT + 1:
+    case VIRTGPU_PARAM_QUEUE_DPC_COUNT + 2:
+    case VIRTGPU_PARAM_QUEUE_DPC_COUNT + 3:
+        *output = Context->QueueDpcCount[*input - VIRTGPU_PARAM_QUEUE_DPC_COUNT];
+        break;
+    case VIRTGPU_PARAM_QUEUE_DPC_TIME:
+    case VIRTGPU_PARAM_QUEUE_DPC_TIME + 1:
+    case VIRTGPU_PARAM_QUEUE_DPC_TIME + 2:
+    case VIRTGPU_PARAM_QUEUE_DPC_TIME + 3:
+        *output = Context->QueueDpcTime[*input - VIRTGPU_PARAM_QUEUE_DPC_TIME];
+        break;
+    case VIRTGPU_PARAM_QUEUE_DPC_MAX_TIME:
+    case VIRTGPU_PARAM_QUEUE_DPC_MAX_TIME + 1:
+    case VIRTGPU_PARAM_QUEUE_DPC_MAX_TIME + 2:
+    case VIRTGPU_PARAM_QUEUE_DPC_MAX_TIME + 3:
+        *output = Context->QueueDpcMaxTime[*input - VIRTGPU_PARAM_QUEUE_DPC_MAX_TIME];
+        break;
+    case VIRTGPU_PARAM_QUEUE_MODE_SWITCHES:
+    case VIRTGPU_PARAM_QUEUE_MODE_SWITCHES + 1:
+    case VIRTGPU_PARAM_QUEUE_MODE_SWITCHES + 2:
+    case VIRTGPU_PARAM_QUEUE_MODE_SWITCHES + 3:
+        *output = Context->QueueModeSwitchCount[*input - VIRTGPU_PARAM_QUEUE_MODE_SWITCHES];
+        break;
     default:
         if ((Context->Capabilities & (1LL << ((*input) - 1))))
         {
@@ -256,18 +558,18 @@ NTSTATUS CtlGetCaps(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size_t
 NTSTATUS CtlInitVirglContext(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                                status;
+    KIRQL                                   savedIrql;
     PVIRGL_CONTEXT                          virglContext;
     WDFMEMORY                               contextParamMem;
     ULONG                                   contextInit = 0;
     ULONG                                   contextId;
+    UINT8                                   priority = VIRTGPU_CONTEXT_PRIORITY_NORMAL;
+    PFILE_CONTEXT                           fileContext;
     struct drm_virtgpu_context_init*        init;
     struct drm_virtgpu_context_set_param*   params;
 
-    // use current process id as virgl context id
-    contextId = HandleToULong(PsGetCurrentProcessId());
-
-    virglContext = GetVirglContextFromList(contextId);
-    if (virglContext)
+    fileContext = GetFileContext(WdfRequestGetFileObject(Request));
+    if (fileContext->VirglContext)
     {
         VGPU_DEBUG_PRINT("virgl context has already been initialized");
         return STATUS_UNSUCCESSFUL;
@@ -316,6 +618,14 @@ NTSTATUS CtlInitVirglContext(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request,
             }
             contextInit |= params[i].value;
             break;
+        case VIRTGPU_CONTEXT_PARAM_PRIORITY:
+            if (params[i].value > VIRTGPU_CONTEXT_PRIORITY_INTERACTIVE)
+            {
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            priority = (UINT8)params[i].value;
+            break;
         case VIRTGPU_CONTEXT_PARAM_NUM_RINGS:
         case VIRTGPU_CONTEXT_PARAM_POLL_RINGS_MASK:
         default:
@@ -338,55 +648,244 @@ NTSTATUS CtlInitVirglContext(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request,
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    // initialize virgl context
+    // the id is not reused, a late response of a destroyed context must not reach a new one
+    GetIdFromIdrWithoutCache(VIRGL_CONTEXT_ID_TYPE, &contextId, sizeof(ULONG32));
+
+    virglContext->ResourceTable = AllocateResourceTable(RESOURCE_TABLE_MIN_SIZE);
+    if (virglContext->ResourceTable == NULL)
+    {
+        VGPU_DEBUG_PRINT("allocate resource table failed");
+        ExFreePoolWithTag(virglContext, VIRTIO_VGPU_MEMORY_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // allocated up front, the completion worker can't fail to hand over the destroy
+    virglContext->DestroyWorkItem = IoAllocateWorkItem(WdfDeviceWdmGetDeviceObject((WDFDEVICE)WdfObjectContextGetObject(Context)));
+    if (virglContext->DestroyWorkItem == NULL)
+    {
+        VGPU_DEBUG_PRINT("allocate destroy work item failed");
+        ExFreePoolWithTag(virglContext->ResourceTable, VIRTIO_VGPU_MEMORY_TAG);
+        ExFreePoolWithTag(virglContext, VIRTIO_VGPU_MEMORY_TAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // initialize virgl context, the handle owns the first reference
     virglContext->Id = contextId;
+    virglContext->RefCount = 1;
+    virglContext->ResourceTableCount = 0;
     virglContext->DeviceContext = Context;
     KeInitializeSpinLock(&virglContext->ResourceListSpinLock);
     InitializeListHead(&virglContext->ResourceList);
-    ExInterlockedInsertHeadList(&VirglContextList, &virglContext->Entry, &VirglContextListSpinLock);
+    InitializeListHead(&virglContext->ResourceCache);
+    virglContext->ResourceCacheSize = 0;
+    virglContext->ResourceCacheHits = 0;
+    virglContext->ResourceCacheMisses = 0;
+    InitializeListHead(&virglContext->RetireList);
+    virglContext->RetireCount = 0;
+    virglContext->Priority = priority;
+
+    // the context is bound to one queue for its lifetime to keep its commands in order
+    virglContext->QueueIndex = SelectCommandQueue(Context, priority);
+    InitializeSubmitList(virglContext);
+    InitializeCoalescer(virglContext);
+    SpinLock(&savedIrql, &VirglContextListSpinLock);
+    InsertHeadListEpoch(&VirglContextList, &virglContext->Entry);
+    SpinUnLock(savedIrql, &VirglContextListSpinLock);
 
     CreateVirglContext(Context, contextId, contextInit);
     VGPU_DEBUG_LOG("create virgl context id=%d", contextId);
 
+    // a racing init on the same handle won, drop ours
+    if (InterlockedCompareExchangePointer((PVOID volatile*)&fileContext->VirglContext, virglContext, NULL) != NULL)
+    {
+        VGPU_DEBUG_PRINT("virgl context has already been initialized");
+        PutVirglContext(virglContext);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return status;
+}
+
+NTSTATUS CtlSetVirglContextParam(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+{
+    NTSTATUS                                status;
+    struct drm_virtgpu_context_set_param*   param;
+
+    status = WdfRequestRetrieveInputBuffer(Request, InputBufferLength, &param, bytesReturn);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("WdfRequestRetrieveInputBuffer failed status=0x%08x", status);
+        return status;
+    }
+
+    if (*bytesReturn != sizeof(struct drm_virtgpu_context_set_param))
+    {
+        VGPU_DEBUG_LOG("get wrong buffer size=%lld", *bytesReturn);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (!VirglContext)
+    {
+        VGPU_DEBUG_PRINT("get virgl context failed");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    switch (param->param) {
+    case VIRTGPU_CONTEXT_PARAM_PRIORITY:
+        if (param->value > VIRTGPU_CONTEXT_PRIORITY_INTERACTIVE)
+        {
+            VGPU_DEBUG_LOG("invalid priority=%lld", param->value);
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        // the queue was bound at init, only the scheduling order follows the new priority
+        SetVirglContextPriority(VirglContext, (UINT8)param->value);
+        VGPU_DEBUG_LOG("set virgl context id=%d priority=%lld", VirglContext->Id, param->value);
+        break;
+    default:
+        VGPU_DEBUG_PRINT("unimplement features");
+        return STATUS_UNSUCCESSFUL;
+    }
+
     return status;
 }
 
+// the last reference destroys the context, it must be dropped at passive level
+VOID PutVirglContext(PVIRGL_CONTEXT VirglContext)
+{
+    if (InterlockedDecrement(&VirglContext->RefCount) == 0)
+    {
+        CtlDestroyVirglContext(VirglContext);
+    }
+}
+
+VOID DestroyVirglContextWorkItem(PDEVICE_OBJECT DeviceObject, PVOID Context)
+{
+    PVIRGL_CONTEXT  virglContext = Context;
+    PDEVICE_CONTEXT context = virglContext->DeviceContext;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    CtlDestroyVirglContext(virglContext);
+    InterlockedDecrement(&context->DestroyPendingCount);
+}
+
+// the destroy waits for the completion worker, so the worker hands the last reference to a system thread
+VOID PutVirglContextDeferred(PVIRGL_CONTEXT VirglContext)
+{
+    if (InterlockedDecrement(&VirglContext->RefCount) == 0)
+    {
+        InterlockedIncrement(&VirglContext->DeviceContext->DestroyPendingCount);
+        IoQueueWorkItem(VirglContext->DestroyWorkItem, DestroyVirglContextWorkItem, DelayedWorkQueue, VirglContext);
+    }
+}
+
+// the host may still read or write the guest backings, wait until it is done with all of them
+VOID WaitResourcesIdle(PVIRGL_CONTEXT VirglContext, PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY     item;
+    PVIRGL_RESOURCE resource;
+
+    for (item = ListHead->Flink; item != ListHead; item = item->Flink)
+    {
+        resource = CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry);
+
+        // a blob stays busy until its map completed
+        if (KeReadStateEvent(&resource->StateEvent) == 0)
+        {
+            KeWaitForSingleObject(&resource->StateEvent, Executive, KernelMode, FALSE, NULL);
+        }
+    }
+}
+
 NTSTATUS CtlDestroyVirglContext(IN PVIRGL_CONTEXT VirglContext)
 {
     KIRQL               savedIrql;
-    PLIST_ENTRY         item;
-    PVIRGL_RESOURCE     resource;
+    LIST_ENTRY          deleteList;
+
+    // drop the submissions still waiting for their in fences
+    UninitializeCoalescer(VirglContext);
+    FlushSubmitList(VirglContext);
+
+    // the context is still listed, so the completions of the commands the host is running find it
+    if (KeReadStateEvent(&VirglContext->InFlightIdleEvent) == 0)
+    {
+        KeWaitForSingleObject(&VirglContext->InFlightIdleEvent, Executive, KernelMode, FALSE, NULL);
+    }
+
+    // no ioctl can reach the context anymore, the lists only change under our hands
+    WaitResourcesIdle(VirglContext, &VirglContext->ResourceList);
+    WaitResourcesIdle(VirglContext, &VirglContext->RetireList);
+
+    // let the completions already handed to the worker land on the context
+    FlushCompletionWork(VirglContext->DeviceContext);
 
     SpinLock(&savedIrql, &VirglContextListSpinLock);
-    RemoveEntryListUnsafe(&VirglContext->Entry);
+    RemoveEntryListEpoch(&VirglContext->Entry);
     SpinUnLock(savedIrql, &VirglContextListSpinLock);
 
+    // no reader can reach the context or its resources after this, including a worker callback still running
+    EpochSynchronize();
+
+    VGPU_DEBUG_LOG("virgl context id=%d submit latency p50=%lldus p90=%lldus p99=%lldus", VirglContext->Id,
+        GetSubmitLatencyPercentile(VirglContext, 50), GetSubmitLatencyPercentile(VirglContext, 90), GetSubmitLatencyPercentile(VirglContext, 99));
+
+    TrimResourceCache(VirglContext, TRUE);
+    ReclaimRetiredResources(VirglContext, TRUE);
+
+    InitializeListHead(&deleteList);
     SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
     while (!IsListEmpty(&VirglContext->ResourceList))
     {
-        item = RemoveTailList(&VirglContext->ResourceList);
-        resource = CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry);
-
-        DeleteResource(VirglContext, resource);
-        ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
+        InsertTailList(&deleteList, RemoveHeadList(&VirglContext->ResourceList));
     }
     SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+    DeleteResources(VirglContext, &deleteList);
+    ExFreePoolWithTag(VirglContext->ResourceTable, VIRTIO_VGPU_MEMORY_TAG);
 
     // tell the host to destroy the virgl context
     DestroyVirglContext(VirglContext->DeviceContext, VirglContext->Id);
     VGPU_DEBUG_LOG("destroy virgl context id=%d", VirglContext->Id);
 
+    // a work item may be freed by its own routine
+    IoFreeWorkItem(VirglContext->DestroyWorkItem);
     ExFreePoolWithTag(VirglContext, VIRTIO_VGPU_MEMORY_TAG);
 
     return STATUS_SUCCESS;
 }
 
-NTSTATUS CtlCreateResource(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+VOID GetResourceCreateParam(struct drm_virtgpu_resource_create* CreateResource, PVIRTGPU_RESOURCE_CREATE_PARAM Create, PVIRGL_RESOURCE_KEY Key)
+{
+    Key->Target = CreateResource->target;
+    Key->Format = CreateResource->format;
+    Key->Bind = CreateResource->bind;
+    Key->Width = CreateResource->width;
+    Key->Height = CreateResource->height;
+    Key->Depth = CreateResource->depth;
+    Key->ArraySize = CreateResource->array_size;
+    Key->LastLevel = CreateResource->last_level;
+    Key->NrSamples = CreateResource->nr_samples;
+    Key->Flags = CreateResource->flags;
+    Key->Size = CreateResource->size;
+
+    Create->format = CreateResource->format;
+    Create->width = CreateResource->width;
+    Create->height = CreateResource->height;
+    Create->array_size = CreateResource->array_size;
+    Create->bind = CreateResource->bind;
+    Create->target = CreateResource->target;
+    Create->depth = CreateResource->depth;
+    Create->flags = CreateResource->flags;
+    Create->last_level = CreateResource->last_level;
+    Create->nr_samples = CreateResource->nr_samples;
+}
+
+NTSTATUS CtlCreateResource(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                                    status;
     PVIRGL_RESOURCE                             resource;
-    PVIRGL_CONTEXT                              virglContext;
     VIRTGPU_RESOURCE_CREATE_PARAM               create;
+    VIRGL_RESOURCE_KEY                          key;
     struct drm_virtgpu_resource_create*         pCreateResource;
     struct drm_virtgpu_resource_create_resp*    pCreateResourceResp;
 
@@ -416,44 +915,59 @@ NTSTATUS CtlCreateResource(IN WDFREQUEST Request, IN size_t OutputBufferLength,
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
     }
 
-    resource = ExAllocateFromLookasideListEx(&virglContext->DeviceContext->VirglResourceLookAsideList);
+    GetResourceCreateParam(pCreateResource, &create, &key);
+
+    // a recently closed resource of the same shape still exists on the host
+    resource = pCreateResource->size != 1 ? TakeCachedResource(VirglContext, &key) : NULL;
+    if (resource)
+    {
+        RtlZeroMemory(resource->Buffer.Memory.VirtualAddress, resource->Buffer.Size);
+
+        if (!InsertResource(VirglContext, resource))
+        {
+            PutResource(VirglContext, resource);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        pCreateResourceResp->res_handle = pCreateResourceResp->bo_handle = resource->Id;
+        VGPU_DEBUG_LOG("reuse resource id=%d size=%d", resource->Id, pCreateResource->size);
+        return status;
+    }
+    TrimResourceCache(VirglContext, FALSE);
+    ReclaimRetiredResources(VirglContext, FALSE);
+
+    resource = ExAllocateFromLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList);
     if (resource == NULL)
     {
         VGPU_DEBUG_PRINT("allocate memory failed");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    create.format = pCreateResource->format;
-    create.width = pCreateResource->width;
-    create.height = pCreateResource->height;
-    create.array_size = pCreateResource->array_size;
-    create.bind = pCreateResource->bind;
-    create.target = pCreateResource->target;
-    create.depth = pCreateResource->depth;
-    create.flags = pCreateResource->flags;
-    create.last_level = pCreateResource->last_level;
-    create.nr_samples = pCreateResource->nr_samples;
+    resource->Key = key;
 
-    GetIdFromIdrWithoutCache(VIRGL_RESOURCE_ID_TYPE, &resource->Id, sizeof(ULONG32));
-    resource->FenceId = 0;
+    if (!GetResourceIdFromIdr(&resource->Id))
+    {
+        ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    resource->RefCount = 1;
 
     // init state event to false means the resource is busy now
     // we make all resource as idle when created
+    resource->InFlightCount = 0;
+    KeInitializeSpinLock(&resource->StateSpinLock);
     KeInitializeEvent(&resource->StateEvent, NotificationEvent, TRUE);
 
-    // treat all kind of resources as 3d resoures, they would be handled in virglrenderer
-    Create3DResource(virglContext->DeviceContext, virglContext->Id, resource->Id, &create, 0);
-
     // VIRGL_CAP_COPY_TRANSFER set size=1 of resource without buffer
     resource->bForBuffer = pCreateResource->size != 1;
     resource->bForBlob = FALSE;
+    resource->bClosed = FALSE;
 
     if (resource->bForBuffer)
     {
@@ -471,17 +985,39 @@ NTSTATUS CtlCreateResource(IN WDFREQUEST Request, IN size_t OutputBufferLength,
 
         if (!AllocateVgpuMemory(resource->Buffer.Size, &resource->Buffer.Memory))
         {
+            // the host never saw the id, give it back with the resource
             VGPU_DEBUG_PRINT("allocate dma memory failed");
+            PutResourceIdToIdr(resource->Id);
+            ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
         // clear memory to avoid crash in cinema4d sometime
         RtlZeroMemory(resource->Buffer.Memory.VirtualAddress, resource->Buffer.Size);
-        AttachResourceBacking(virglContext->DeviceContext, virglContext->Id, resource);
     }
 
-    // insert to the resource list
-    ExInterlockedInsertHeadList(&virglContext->ResourceList, &resource->Entry, &virglContext->ResourceListSpinLock);
+    // treat all kind of resources as 3d resoures, they would be handled in virglrenderer
+    if (resource->bForBuffer && (VirglContext->DeviceContext->Capabilities & VIRTIO_VGPU_CAP_CREATE_WITH_BACKING))
+    {
+        // create the resource and attach its backing with one command
+        Create3DResourceWithBacking(VirglContext->DeviceContext, VirglContext->Id, resource, &create);
+    }
+    else
+    {
+        Create3DResource(VirglContext->DeviceContext, VirglContext->Id, resource->Id, &create, 0);
+
+        if (resource->bForBuffer)
+        {
+            AttachResourceBacking(VirglContext->DeviceContext, VirglContext->Id, resource);
+        }
+    }
+
+    // insert to the resource table, the host knows the resource already so it is dropped like a closed one
+    if (!InsertResource(VirglContext, resource))
+    {
+        PutResource(VirglContext, resource);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     // different from gem object in linux
     pCreateResourceResp->res_handle = pCreateResourceResp->bo_handle = resource->Id;
@@ -490,11 +1026,241 @@ NTSTATUS CtlCreateResource(IN WDFREQUEST Request, IN size_t OutputBufferLength,
     return status;
 }
 
-NTSTATUS CtlCreateBlobResource(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+NTSTATUS CtlCreateResources(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+{
+    NTSTATUS                                    status;
+    ULONG                                       index;
+    ULONG                                       count;
+    ULONG                                       newCount = 0;
+    ULONG                                       newIndex;
+    ULONG                                       prepared;
+    SIZE_T                                      totalSize = 0;
+    SIZE_T                                      offset = 0;
+    BOOLEAN                                     bPooled = FALSE;
+    KIRQL                                       savedIrql;
+    MEMORY_DESCRIPTOR                           memory;
+    VIRGL_RESOURCE_KEY                          key;
+    PVIRGL_RESOURCE                             resource;
+    PVIRGL_RESOURCE*                            resources;
+    PVIRGL_RESOURCE*                            newResources;
+    PVIRTGPU_RESOURCE_CREATE_PARAM              creates;
+    struct drm_virtgpu_resource_create*         pCreateResources;
+    struct drm_virtgpu_resource_create_resp*    pCreateResourceResps;
+
+    status = WdfRequestRetrieveInputBuffer(Request, InputBufferLength, &pCreateResources, bytesReturn);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("WdfRequestRetrieveInputBuffer failed status=0x%08x", status);
+        return status;
+    }
+
+    count = (ULONG)(*bytesReturn / sizeof(struct drm_virtgpu_resource_create));
+    if (count == 0 || count > RESOURCE_CREATE_BATCH_MAX || *bytesReturn != count * sizeof(struct drm_virtgpu_resource_create))
+    {
+        VGPU_DEBUG_LOG("get wrong buffer size=%lld", *bytesReturn);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, OutputBufferLength, &pCreateResourceResps, bytesReturn);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("WdfRequestRetrieveOutputBuffer failed status=0x%08x", status);
+        return status;
+    }
+
+    if (*bytesReturn != count * sizeof(struct drm_virtgpu_resource_create_resp))
+    {
+        VGPU_DEBUG_LOG("get wrong buffer size=%lld", *bytesReturn);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    if (!VirglContext)
+    {
+        VGPU_DEBUG_PRINT("get virgl context failed");
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    resources = ExAllocatePool2(POOL_FLAG_NON_PAGED, count * (2 * sizeof(PVIRGL_RESOURCE) + sizeof(VIRTGPU_RESOURCE_CREATE_PARAM)), VIRTIO_VGPU_MEMORY_TAG);
+    if (!resources)
+    {
+        VGPU_DEBUG_PRINT("allocate memory failed");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    newResources = resources + count;
+    creates = (PVIRTGPU_RESOURCE_CREATE_PARAM)(newResources + count);
+
+    for (index = 0; index < count; index++)
+    {
+        GetResourceCreateParam(&pCreateResources[index], &creates[newCount], &key);
+
+        // a recently closed resource of the same shape still exists on the host
+        resource = pCreateResources[index].size != 1 ? TakeCachedResource(VirglContext, &key) : NULL;
+        if (resource)
+        {
+            RtlZeroMemory(resource->Buffer.Memory.VirtualAddress, resource->Buffer.Size);
+            resources[index] = resource;
+            continue;
+        }
+
+        resource = ExAllocateFromLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList);
+        if (resource == NULL)
+        {
+            VGPU_DEBUG_PRINT("allocate memory failed");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        if (!GetResourceIdFromIdr(&resource->Id))
+        {
+            ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        resource->Key = key;
+        resource->RefCount = 1;
+        resource->InFlightCount = 0;
+        KeInitializeSpinLock(&resource->StateSpinLock);
+        KeInitializeEvent(&resource->StateEvent, NotificationEvent, TRUE);
+        resource->bForBuffer = pCreateResources[index].size != 1;
+        resource->bForBlob = FALSE;
+        resource->bClosed = FALSE;
+        resource->Buffer.Share.pMdl = NULL;
+        resource->Buffer.Memory.VirtualAddress = NULL;
+
+        if (resource->bForBuffer)
+        {
+            resource->Buffer.Size = pCreateResources[index].size == 0 ? PAGE_SIZE : ROUND_UP(pCreateResources[index].size, PAGE_SIZE);
+            totalSize += resource->Buffer.Size;
+        }
+
+        resources[index] = resource;
+        newResources[newCount++] = resource;
+    }
+    prepared = index;
+
+    if (NT_SUCCESS(status) && newCount)
+    {
+        TrimResourceCache(VirglContext, FALSE);
+        ReclaimRetiredResources(VirglContext, FALSE);
+
+        // carve all backings out of one run of the pool, fall back to a run per resource when it is fragmented
+        if (totalSize && AllocateVgpuMemory(totalSize, &memory))
+        {
+            bPooled = TRUE;
+            RtlZeroMemory(memory.VirtualAddress, totalSize);
+
+            for (index = 0; index < newCount; index++)
+            {
+                if (newResources[index]->bForBuffer)
+                {
+                    newResources[index]->Buffer.Memory.VirtualAddress = (PUINT8)memory.VirtualAddress + offset;
+                    newResources[index]->Buffer.Memory.PhysicalAddress.QuadPart = memory.PhysicalAddress.QuadPart + offset;
+                    offset += newResources[index]->Buffer.Size;
+                }
+            }
+        }
+        else
+        {
+            for (index = 0; index < newCount; index++)
+            {
+                if (!newResources[index]->bForBuffer)
+                {
+                    continue;
+                }
+
+                if (!AllocateVgpuMemory(newResources[index]->Buffer.Size, &newResources[index]->Buffer.Memory))
+                {
+                    VGPU_DEBUG_PRINT("allocate dma memory failed");
+                    newResources[index]->Buffer.Memory.VirtualAddress = NULL;
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                    break;
+                }
+                RtlZeroMemory(newResources[index]->Buffer.Memory.VirtualAddress, newResources[index]->Buffer.Size);
+            }
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // the new resources keep the order of the batch, anything else was taken from the cache
+        for (index = 0, newIndex = 0; index < prepared; index++)
+        {
+            resource = resources[index];
+            if (newIndex < newCount && resource == newResources[newIndex])
+            {
+                // nothing of the new resources has reached the host yet
+                if (!bPooled && resource->Buffer.Memory.VirtualAddress)
+                {
+                    FreeVgpuMemory(resource->Buffer.Memory.VirtualAddress, resource->Buffer.Size);
+                }
+                PutResourceIdToIdr(resource->Id);
+                ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
+                newIndex++;
+            }
+            else if (!PutResourceToCache(VirglContext, resource))
+            {
+                PutResource(VirglContext, resource);
+            }
+        }
+
+        if (bPooled)
+        {
+            FreeVgpuMemory(memory.VirtualAddress, totalSize);
+        }
+
+        ExFreePoolWithTag(resources, VIRTIO_VGPU_MEMORY_TAG);
+        return status;
+    }
+
+    // publish all host commands of the batch with a single kick
+    CreateResources(VirglContext->DeviceContext, VirglContext->Id, newResources, creates, newCount);
+
+    for (index = 0; index < count; index++)
+    {
+        if (!InsertResource(VirglContext, resources[index]))
+        {
+            VGPU_DEBUG_LOG("insert resource failed id=%d", resources[index]->Id);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        // the batch fails as a whole, take the inserted resources out of the table before dropping them all
+        SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+        for (newIndex = 0; newIndex < index; newIndex++)
+        {
+            resources[newIndex]->bClosed = TRUE;
+            RemoveResourceUnsafe(VirglContext, resources[newIndex]);
+        }
+        SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+
+        for (index = 0; index < count; index++)
+        {
+            PutResource(VirglContext, resources[index]);
+        }
+
+        ExFreePoolWithTag(resources, VIRTIO_VGPU_MEMORY_TAG);
+        return status;
+    }
+
+    for (index = 0; index < count; index++)
+    {
+        pCreateResourceResps[index].res_handle = pCreateResourceResps[index].bo_handle = resources[index]->Id;
+    }
+
+    VGPU_DEBUG_LOG("create resources count=%d new=%d size=%lld", count, newCount, totalSize);
+
+    ExFreePoolWithTag(resources, VIRTIO_VGPU_MEMORY_TAG);
+    return status;
+}
+
+NTSTATUS CtlCreateBlobResource(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                                    status;
     PVIRGL_RESOURCE                             resource;
-    PVIRGL_CONTEXT                              virglContext;
     VIRTGPU_BLOB_RESOURCE_CREATE_PARAM          create;
     struct drm_virtgpu_resource_create_blob*    pCreateResourceBlob;
     struct drm_virtgpu_resource_create_resp*    pCreateResourceResp;
@@ -525,14 +1291,13 @@ NTSTATUS CtlCreateBlobResource(IN WDFREQUEST Request, IN size_t OutputBufferLeng
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
     }
 
-    resource = ExAllocateFromLookasideListEx(&virglContext->DeviceContext->VirglResourceLookAsideList);
+    resource = ExAllocateFromLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList);
     if (resource == NULL)
     {
         VGPU_DEBUG_PRINT("allocate memory failed");
@@ -540,12 +1305,22 @@ NTSTATUS CtlCreateBlobResource(IN WDFREQUEST Request, IN size_t OutputBufferLeng
     }
 
     resource->bForBlob = TRUE;
+    resource->bClosed = FALSE;
     resource->bForBuffer = TRUE;
     resource->Buffer.Share.pMdl = NULL;
-    resource->FenceId = 0;
-    GetIdFromIdrWithoutCache(VIRGL_RESOURCE_ID_TYPE, &resource->Id, sizeof(ULONG32));
+    resource->Buffer.Share.CacheType = MmNonCached;
+    resource->Buffer.Memory.VirtualAddress = NULL;
+    resource->Buffer.Size = 0;
+    resource->RefCount = 1;
+    if (!GetResourceIdFromIdr(&resource->Id))
+    {
+        ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     // initialize blob resource as busy until map blob callback was completed
+    resource->InFlightCount = 1;
+    KeInitializeSpinLock(&resource->StateSpinLock);
     KeInitializeEvent(&resource->StateEvent, NotificationEvent, FALSE);
 
     create.nr_entries = 0;
@@ -563,13 +1338,19 @@ NTSTATUS CtlCreateBlobResource(IN WDFREQUEST Request, IN size_t OutputBufferLeng
     create.last_level = pCreateResourceBlob->last_level;
     create.nr_samples = pCreateResourceBlob->nr_samples;
     create.flags = pCreateResourceBlob->flags;
-    CreateBlobResource(virglContext->DeviceContext, virglContext->Id, resource->Id, &create, 0);
+    CreateBlobResource(VirglContext->DeviceContext, VirglContext->Id, resource->Id, &create, 0);
 
-    // insert into resource list before map it
-    ExInterlockedInsertHeadList(&virglContext->ResourceList, &resource->Entry, &virglContext->ResourceListSpinLock);
+    // insert into resource table before map it
+    if (!InsertResource(VirglContext, resource))
+    {
+        // not mapped yet, only the host side has to go
+        UnrefResource(VirglContext->DeviceContext, VirglContext->Id, resource->Id);
+        ExFreeToLookasideListEx(&VirglContext->DeviceContext->VirglResourceLookAsideList, resource);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     // map blob resource
-    MapBlobResource(virglContext->DeviceContext, virglContext->Id, resource->Id, 0);
+    MapBlobResource(VirglContext->DeviceContext, VirglContext->Id, resource->Id, 0);
 
     pCreateResourceResp->res_handle = pCreateResourceResp->bo_handle = resource->Id;
     VGPU_DEBUG_LOG("create blob resource id=%d size=%d", resource->Id, pCreateResourceBlob->size);
@@ -577,11 +1358,10 @@ NTSTATUS CtlCreateBlobResource(IN WDFREQUEST Request, IN size_t OutputBufferLeng
     return STATUS_SUCCESS;
 }
 
-NTSTATUS CtlCloseResource(IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+NTSTATUS CtlCloseResource(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                status;
     KIRQL                   savedIrql;
-    PVIRGL_CONTEXT          virglContext;
     PVIRGL_RESOURCE         resource;
     struct drm_gem_close*   close;
 
@@ -598,40 +1378,70 @@ NTSTATUS CtlCloseResource(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
     }
 
-    resource = GetResourceFromList(virglContext, close->handle);
+    resource = GetResourceFromList(VirglContext, close->handle);
     if (!resource)
     {
         VGPU_DEBUG_LOG("get resource failed id=%d", close->handle);
         return STATUS_UNSUCCESSFUL;
     }
 
-    // FIXME: we didn't put resource id back to idr, because it may conflict with migration
+    // no new reference can be taken through the handle after this
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+    if (resource->bClosed)
+    {
+        SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+        PutResource(VirglContext, resource);
+        VGPU_DEBUG_LOG("resource was closed already id=%d", close->handle);
+        return STATUS_UNSUCCESSFUL;
+    }
+    resource->bClosed = TRUE;
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+    KeMemoryBarrier();
 
-    // delete the resource from the virgl context resource list
-    SpinLock(&savedIrql, &virglContext->ResourceListSpinLock);
-    RemoveEntryListUnsafe(&resource->Entry);
-    SpinUnLock(savedIrql, &virglContext->ResourceListSpinLock);
+    // the user mapping must go away in the context of its process
+    if (resource->bForBuffer && resource->Buffer.Share.pMdl)
+    {
+        DeleteUserShareMemory(&resource->Buffer.Share);
+        resource->Buffer.Share.pMdl = NULL;
+    }
+
+    // the id goes back to the idr when the host completes the unref, see VirtioVgpuReadFromQueue
+
+    // keep an idle resource nobody else holds for a later create of the same shape, retire it otherwise
+    if (IsResourceCacheable(resource) && resource->RefCount == 2)
+    {
+        SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+        RemoveResourceUnsafe(VirglContext, resource);
+        SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
 
-    // free resource
-    DeleteResource(virglContext, resource);
-    ExFreeToLookasideListEx(&virglContext->DeviceContext->VirglResourceLookAsideList, resource);
+        // the table reference moves to the cache
+        InterlockedDecrement(&resource->RefCount);
+        if (!PutResourceToCache(VirglContext, resource))
+        {
+            PutResource(VirglContext, resource);
+        }
+        TrimResourceCache(VirglContext, FALSE);
+    }
+    else
+    {
+        RetireResource(VirglContext, resource);
+        PutResource(VirglContext, resource);
+    }
     VGPU_DEBUG_LOG("close resource id=%d", close->handle);
 
     return status;
 }
 
-NTSTATUS CtlWait(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+NTSTATUS CtlWait(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                    status;
     ULONG32*                    result;
-    PVIRGL_CONTEXT              virglContext;
     PVIRGL_RESOURCE             resource;
     struct drm_virtgpu_3d_wait* cmd;
 
@@ -661,20 +1471,22 @@ NTSTATUS CtlWait(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
     }
 
-    resource = GetResourceFromListUnsafe(virglContext, cmd->handle);
+    resource = GetResourceFromList(VirglContext, cmd->handle);
     if (!resource)
     {
         VGPU_DEBUG_LOG("get resource failed id=%d", cmd->handle);
         return STATUS_UNSUCCESSFUL;
     }
 
+    // an explicit wait must not be delayed by the coalescing
+    FlushCoalescedSubmit(VirglContext);
+
     if (cmd->flags & VIRTGPU_WAIT_NOWAIT)
     {
         if (KeReadStateEvent(&resource->StateEvent) == 0)
@@ -688,6 +1500,10 @@ NTSTATUS CtlWait(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t
             *result = 0;
         }
     }
+    else if (SpinWaitForEvent(VirglContext, &resource->StateEvent))
+    {
+        *result = 0;
+    }
     else
     {
         status = KeWaitForSingleObject(&resource->StateEvent, Executive, KernelMode, FALSE, NULL);
@@ -702,14 +1518,14 @@ NTSTATUS CtlWait(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t
         }
     }
 
+    PutResource(VirglContext, resource);
     return status;
 }
 
-NTSTATUS CtlMap(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+NTSTATUS CtlMap(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                status;
     ULONG64*                ptr;
-    PVIRGL_CONTEXT          virglContext;
     PVIRGL_RESOURCE         resource;
     struct drm_virtgpu_map* cmd;
 
@@ -739,14 +1555,13 @@ NTSTATUS CtlMap(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t I
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
     }
 
-    resource = GetResourceFromList(virglContext, cmd->handle);
+    resource = GetResourceFromList(VirglContext, cmd->handle);
     if (!resource)
     {
         VGPU_DEBUG_LOG("get resource failed id=%d", cmd->handle);
@@ -756,6 +1571,7 @@ NTSTATUS CtlMap(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t I
     if (!resource->bForBuffer)
     {
         VGPU_DEBUG_LOG("fence resource can't be mapped id=%d", cmd->handle);
+        PutResource(VirglContext, resource);
         return STATUS_UNSUCCESSFUL;
     }
 
@@ -769,11 +1585,17 @@ NTSTATUS CtlMap(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t I
         // wait for resource to be idle
         if (!KeReadStateEvent(&resource->StateEvent))
         {
+            FlushCoalescedSubmit(VirglContext);
             KeWaitForSingleObject(&resource->StateEvent, Executive, KernelMode, FALSE, NULL);
         }
 
         resource->Buffer.Share.KernelAddress = resource->Buffer.Memory.VirtualAddress;
         resource->Buffer.Share.Size = resource->Buffer.Size;
+        if (!resource->bForBlob)
+        {
+            // the pool is ordinary cached memory
+            resource->Buffer.Share.CacheType = MmCached;
+        }
         if (CreateUserShareMemory(&resource->Buffer.Share))
         {
             *ptr = (ULONG64)resource->Buffer.Share.UserAdderss;
@@ -782,17 +1604,17 @@ NTSTATUS CtlMap(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t I
         {
             resource->Buffer.Share.pMdl = NULL;
             VGPU_DEBUG_PRINT("create share memory failed");
-            return STATUS_UNSUCCESSFUL;
+            status = STATUS_UNSUCCESSFUL;
         }
     }
 
+    PutResource(VirglContext, resource);
     return status;
 }
 
-NTSTATUS CtlTransferHost(IN BOOLEAN ToHost, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+NTSTATUS CtlTransferHost(IN PVIRGL_CONTEXT VirglContext, IN BOOLEAN ToHost, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                        status;
-    PVIRGL_CONTEXT                  virglContext;
     PVIRGL_RESOURCE                 resource;
     struct drm_virtgpu_3d_transfer* cmd;
 
@@ -809,14 +1631,13 @@ NTSTATUS CtlTransferHost(IN BOOLEAN ToHost, IN WDFREQUEST Request, IN size_t Inp
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
     }
 
-    resource = GetResourceFromListUnsafe(virglContext, cmd->bo_handle);
+    resource = GetResourceFromList(VirglContext, cmd->bo_handle);
     if (!resource)
     {
         VGPU_DEBUG_LOG("get resource failed id=%d", cmd->bo_handle);
@@ -837,23 +1658,40 @@ NTSTATUS CtlTransferHost(IN BOOLEAN ToHost, IN WDFREQUEST Request, IN size_t Inp
     transfer3d.stride = cmd->stride;
     transfer3d.resource_id = resource->Id;
 
-    UpdateResourceState(virglContext, &resource->Id, 1, TRUE, 0);
-    TransferHost3D(virglContext->DeviceContext, virglContext->Id, &transfer3d, 0, ToHost);
+    // the scheduler keeps the transfer in order with the submissions of the context
+    UpdateResourceState(VirglContext, &resource->Id, 1, TRUE);
+    FlushCoalescedSubmit(VirglContext);
+    QueueSubmitCommand(VirglContext, AllocateTransferCommand(VirglContext->DeviceContext, VirglContext->Id, &transfer3d, 0, ToHost));
+    PutResource(VirglContext, resource);
 
     return status;
 }
 
-NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
+// drop the fences of a submission which was never queued
+VOID ReleaseSubmitFences(PVOID InFence, PVOID OutFence)
+{
+    if (InFence)
+    {
+        ObDereferenceObject(InFence);
+    }
+
+    if (OutFence)
+    {
+        ObDereferenceObject(OutFence);
+    }
+}
+
+NTSTATUS CtlSubmitCommand(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn)
 {
     NTSTATUS                        status;
-    PVIRGL_CONTEXT                  virglContext;
     WDFMEMORY                       wdfMemory;
     MEMORY_DESCRIPTOR               kernelCommandBuffer;
     PVOID                           userCommandBuffer;
-    PVOID                           boHandles;
-    SIZE_T                          boHandlesSize;
+    PVOID                           boHandles = NULL;
+    SIZE_T                          boHandlesSize = 0;
     SIZE_T                          alignCommandSize;
-    PVOID                           inFence;
+    PVGPU_BUFFER                    buffer;
+    PVOID                           inFence = NULL;
     ULONG64                         fenceId = 0;
     PVOID                           outFence = NULL;
     PVOID                           boHandlesBak = NULL;
@@ -872,8 +1710,7 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
         return STATUS_UNSUCCESSFUL;
     }
 
-    virglContext = GetVirglContextFromListUnsafe(HandleToULong(PsGetCurrentProcessId()));
-    if (!virglContext)
+    if (!VirglContext)
     {
         VGPU_DEBUG_PRINT("get virgl context failed");
         return STATUS_UNSUCCESSFUL;
@@ -889,12 +1726,7 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
             return status;
         }
 
-        status = KeWaitForSingleObject(inFence, Executive, KernelMode, FALSE, 0);
-        if (!NT_SUCCESS(status))
-        {
-            VGPU_DEBUG_LOG("KeWaitForSingleObject failed in_fence_fd=%p status=0x%08x", cmd->in_fence_fd, status);
-            return status;
-        }
+        // don't wait here, the submission would be queued until the in fence was signaled
     }
 
     if (cmd->flags & VIRTGPU_EXECBUF_FENCE_FD_OUT)
@@ -904,6 +1736,7 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
         if (!NT_SUCCESS(status))
         {
             VGPU_DEBUG_LOG("ObReferenceObjectByHandle failed out_fence_fd=%p status=0x%08x", cmd->out_fence_fd, status);
+            ReleaseSubmitFences(inFence, NULL);
             return status;
         }
     }
@@ -912,6 +1745,7 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
     if (!NT_SUCCESS(status))
     {
         VGPU_DEBUG_LOG("WdfRequestProbeAndLockUserBufferForRead failed status=0x%08x", status);
+        ReleaseSubmitFences(inFence, outFence);
         return status;
     }
 
@@ -919,26 +1753,10 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
     if (!userCommandBuffer)
     {
         VGPU_DEBUG_PRINT("WdfMemoryGetBuffer failed");
+        ReleaseSubmitFences(inFence, outFence);
         return STATUS_UNSUCCESSFUL;
     }
 
-    // align command buffer to 4096
-    alignCommandSize = ROUND_UP(cmd->size, PAGE_SIZE);
-
-    if (!AllocateVgpuMemory(alignCommandSize, &kernelCommandBuffer))
-    {
-        VGPU_DEBUG_PRINT("get vgpu memory failed");
-        return STATUS_UNSUCCESSFUL;
-    }
-
-    // copy command from user space to kernel space
-    RtlCopyMemory(kernelCommandBuffer.VirtualAddress, userCommandBuffer, cmd->size);
-
-    if (outFence)
-    {
-        GetIdFromIdrWithoutCache(FENCE_ID_TYPE, &fenceId, sizeof(ULONG64));
-    }
-
     if (cmd->num_bo_handles > 0)
     {
         boHandlesSize = sizeof(ULONG32) * cmd->num_bo_handles;
@@ -947,6 +1765,7 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
         if (!NT_SUCCESS(status))
         {
             VGPU_DEBUG_PRINT("WdfRequestProbeAndLockUserBufferForRead bohandles failed");
+            ReleaseSubmitFences(inFence, outFence);
             return status;
         }
 
@@ -954,22 +1773,65 @@ NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OU
         if (!boHandles)
         {
             VGPU_DEBUG_PRINT("WdfMemoryGetBuffer failed");
+            ReleaseSubmitFences(inFence, outFence);
             return STATUS_UNSUCCESSFUL;
         }
+    }
 
-        // make all resources referenced busy
-        UpdateResourceState(virglContext, boHandles, cmd->num_bo_handles, TRUE, fenceId);
+    InterlockedIncrement64(&VirglContext->DeviceContext->ExecbufferCount);
+
+    // small unfenced execbuffers may be merged into the open submission of this context, which makes the resources busy
+    if (!inFence && !outFence && CoalesceSubmitCommand(VirglContext, userCommandBuffer, cmd->size, boHandles, cmd->num_bo_handles))
+    {
+        return STATUS_SUCCESS;
+    }
 
+    if (cmd->num_bo_handles > 0)
+    {
         // backup these handles to make them idle later
         boHandlesBak = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, boHandlesSize, VIRTIO_VGPU_MEMORY_TAG);
         if (!boHandlesBak)
         {
             VGPU_DEBUG_PRINT("allocate memory failed");
+            ReleaseSubmitFences(inFence, outFence);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
         RtlCopyMemory(boHandlesBak, boHandles, boHandlesSize);
     }
 
-    return SubmitCommand(virglContext->DeviceContext, virglContext->Id, &kernelCommandBuffer, alignCommandSize, cmd->size,
-            boHandlesBak, cmd->num_bo_handles, fenceId, outFence);
+    // align command buffer to 4096
+    alignCommandSize = ROUND_UP(cmd->size, PAGE_SIZE);
+
+    if (!AllocateVgpuMemory(alignCommandSize, &kernelCommandBuffer))
+    {
+        VGPU_DEBUG_PRINT("get vgpu memory failed");
+        if (boHandlesBak)
+        {
+            ExFreePoolWithTag(boHandlesBak, VIRTIO_VGPU_MEMORY_TAG);
+        }
+        ReleaseSubmitFences(inFence, outFence);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // copy command from user space to kernel space
+    RtlCopyMemory(kernelCommandBuffer.VirtualAddress, userCommandBuffer, cmd->size);
+
+    if (outFence)
+    {
+        GetIdFromIdrWithoutCache(FENCE_ID_TYPE, &fenceId, sizeof(ULONG64));
+    }
+
+    // nothing can fail from here, make all resources referenced busy until the submission completes
+    if (boHandlesBak)
+    {
+        UpdateResourceState(VirglContext, boHandlesBak, cmd->num_bo_handles, TRUE);
+    }
+
+    // anything merged before must reach the host first
+    FlushCoalescedSubmit(VirglContext);
+
+    buffer = AllocateSubmitCommand(VirglContext->DeviceContext, VirglContext->Id, &kernelCommandBuffer, alignCommandSize, cmd->size,
+            boHandlesBak, cmd->num_bo_handles, fenceId, outFence, inFence);
+
+    return QueueSubmitCommand(VirglContext, buffer);
 }
@@ -18,97 +18,106 @@
 #pragma once
 
 #include "ioctl.h"
+#include "epoch.h"
+#include "table.h"
 
 
-FORCEINLINE PVIRGL_RESOURCE GetResourceFromListUnsafe(PVIRGL_CONTEXT VirglContext, ULONG32 Id)
+// must be called inside an epoch read section or under the context list lock
+FORCEINLINE PVIRGL_CONTEXT GetVirglContextFromListUnsafe(ULONG32 VirglContextId)
 {
     PLIST_ENTRY     item;
+    PVIRGL_CONTEXT  virglContext = NULL;
     BOOLEAN         bFind = FALSE;
-    PVIRGL_RESOURCE resource = NULL;
 
-    for (item = VirglContext->ResourceList.Flink; item != &VirglContext->ResourceList; item = item->Flink)
-    {
-        resource = CONTAINING_RECORD(item, VIRGL_RESOURCE, Entry);
-        if (resource->Id == Id)
+    for (item = VirglContextList.Flink; item != &VirglContextList; item = item->Flink) {
+        virglContext = CONTAINING_RECORD(item, VIRGL_CONTEXT, Entry);
+        if (virglContext->Id == VirglContextId)
         {
             bFind = TRUE;
             break;
         }
     }
 
-    return bFind ? resource : NULL;
+    return bFind ? virglContext : NULL;
 }
 
-FORCEINLINE PVIRGL_CONTEXT GetVirglContextFromListUnsafe(ULONG32 VirglContextId)
+// every handle opened on the device owns its own virgl context, the caller must drop it with PutVirglContext
+FORCEINLINE PVIRGL_CONTEXT GetVirglContextFromRequest(WDFREQUEST Request)
 {
-    PLIST_ENTRY     item;
-    PVIRGL_CONTEXT  virglContext = NULL;
-    BOOLEAN         bFind = FALSE;
+    KIRQL           oldIrql;
+    PVIRGL_CONTEXT  virglContext;
 
-    for (item = VirglContextList.Flink; item != &VirglContextList; item = item->Flink) {
-        virglContext = CONTAINING_RECORD(item, VIRGL_CONTEXT, Entry);
-        if (virglContext->Id == VirglContextId)
+    // the destroy swaps the pointer out and frees the context only after the readers left
+    EpochEnter(&oldIrql);
+    virglContext = GetFileContext(WdfRequestGetFileObject(Request))->VirglContext;
+    if (virglContext && !EpochTryReference(&virglContext->RefCount))
+    {
+        virglContext = NULL;
+    }
+    EpochExit(oldIrql);
+
+    return virglContext;
+}
+
+// every queued host command referencing the resource counts once until it completes or is dropped,
+// the state event is set while the count is 0
+FORCEINLINE VOID SetResourceState(PVIRGL_RESOURCE Resource, BOOLEAN Busy)
+{
+    KIRQL   savedIrql;
+    LONG    count = Busy ? InterlockedIncrement(&Resource->InFlightCount) : InterlockedDecrement(&Resource->InFlightCount);
+
+    // only a change between idle and busy touches the event, the last one to take the lock sees the final count
+    if (count == (Busy ? 1 : 0))
+    {
+        SpinLock(&savedIrql, &Resource->StateSpinLock);
+        if (Resource->InFlightCount == 0)
         {
-            bFind = TRUE;
-            break;
+            KeSetEvent(&Resource->StateEvent, 0, FALSE);
+        }
+        else
+        {
+            KeClearEvent(&Resource->StateEvent);
         }
+        SpinUnLock(savedIrql, &Resource->StateSpinLock);
     }
-
-    return bFind ? virglContext : NULL;
 }
 
-FORCEINLINE VOID UpdateResourceState(PVIRGL_CONTEXT VirglContext, PULONG32 ResourceIds, SIZE_T ResourceIdsCount, BOOLEAN Busy, ULONG64 FenceId)
+FORCEINLINE VOID UpdateResourceState(PVIRGL_CONTEXT VirglContext, PULONG32 ResourceIds, SIZE_T ResourceIdsCount, BOOLEAN Busy)
 {
+    KIRQL           oldIrql;
     SIZE_T          index;
-    BOOLEAN         bSignal;
     PVIRGL_RESOURCE resource;
 
+    EpochEnter(&oldIrql);
     for (index = 0; index < ResourceIdsCount; index++)
     {
         resource = GetResourceFromListUnsafe(VirglContext, ResourceIds[index]);
         if (resource)
         {
-            bSignal = FALSE;
-
-            if (FenceId == 0)
-            {
-                bSignal = TRUE;
-            }
-            else if (FenceId >= resource->FenceId)
-            {
-                resource->FenceId = FenceId;
-                bSignal = TRUE;
-            }
-
-            if (bSignal)
-            {
-                if (Busy)
-                {
-                    KeClearEvent(&resource->StateEvent);
-                }
-                else
-                {
-                    KeSetEvent(&resource->StateEvent, 0, FALSE);
-                }
-            }
+            SetResourceState(resource, Busy);
         }
     }
+    EpochExit(oldIrql);
 }
 
-VOID MapBlobResourceCallback(PVIRGL_CONTEXT VirglContext, ULONG32 Id, ULONG64 Gpa, SIZE_T Size);
-PVIRGL_CONTEXT GetVirglContextFromList(ULONG32 VirglContextId);
-PVIRGL_RESOURCE GetResourceFromList(PVIRGL_CONTEXT VirglContext, ULONG32 Id);
+VOID UpdateResourceStatePassive(PVIRGL_CONTEXT VirglContext, PULONG32 ResourceIds, SIZE_T ResourceIdsCount, BOOLEAN Busy);
+VOID MapBlobResourceCallback(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource, ULONG64 Gpa, SIZE_T Size, ULONG32 MapInfo);
+VOID PutResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource);
 
 NTSTATUS CtlInitVirglContext(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
 NTSTATUS CtlDestroyVirglContext(IN PVIRGL_CONTEXT VirglContext);
-NTSTATUS CtlGetParams(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size_t InputBufferLength, IN size_t OutputBufferLength, OUT size_t* bytesReturn);
+VOID PutVirglContext(PVIRGL_CONTEXT VirglContext);
+VOID PutVirglContextDeferred(PVIRGL_CONTEXT VirglContext);
+NTSTATUS CtlSetVirglContextParam(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlGetParams(IN PDEVICE_CONTEXT Context, IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, IN size_t OutputBufferLength, OUT size_t* bytesReturn);
 NTSTATUS CtlGetCaps(IN PDEVICE_CONTEXT Context, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlCreateResource(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlCreateBlobResource(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlCloseResource(IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlWait(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlMap(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlSubmitCommand(IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
-NTSTATUS CtlTransferHost(IN BOOLEAN ToHost, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlCreateResource(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlCreateResources(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlCreateBlobResource(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlCloseResource(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlWait(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlMap(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlSubmitCommand(IN PVIRGL_CONTEXT VirglContext, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
+NTSTATUS CtlTransferHost(IN PVIRGL_CONTEXT VirglContext, IN BOOLEAN ToHost, IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
 NTSTATUS CtlAllocateVgpuMemory(IN WDFREQUEST Request, IN size_t OutputBufferLength, IN size_t InputBufferLength, OUT size_t* bytesReturn);
 NTSTATUS CtlFreeVgpuMemory(IN WDFREQUEST Request, IN size_t InputBufferLength, OUT size_t* bytesReturn);
\ No newline at end of file
@@ -0,0 +1,178 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "epoch.h"
+
+typedef struct _EPOCH_SLOT {
+    volatile LONG64         Epoch;
+    ULONG                   Depth;
+}EPOCH_SLOT, * PEPOCH_SLOT;
+
+typedef struct _EPOCH {
+    BOOLEAN                 bInitialize;
+    volatile LONG64         GlobalEpoch;
+    ULONG                   NumSlots;
+    PEPOCH_SLOT             Slots;
+    KSPIN_LOCK              SpinLock;
+    LIST_ENTRY              RetireList;
+}EPOCH, * PEPOCH;
+
+static EPOCH Epoch = { 0 };
+
+NTSTATUS InitializeEpoch()
+{
+    ASSERT(!Epoch.bInitialize);
+
+    Epoch.NumSlots = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Epoch.Slots = ExAllocatePool2(POOL_FLAG_NON_PAGED, Epoch.NumSlots * sizeof(EPOCH_SLOT), VIRTIO_VGPU_MEMORY_TAG);
+    if (!Epoch.Slots)
+    {
+        VGPU_DEBUG_PRINT("allocate epoch slots failed");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // 0 marks a processor outside of any read section
+    Epoch.GlobalEpoch = 1;
+    KeInitializeSpinLock(&Epoch.SpinLock);
+    InitializeListHead(&Epoch.RetireList);
+    Epoch.bInitialize = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+VOID UninitializeEpoch()
+{
+    if (!Epoch.bInitialize)
+    {
+        return;
+    }
+
+    EpochReclaim(TRUE);
+    ExFreePoolWithTag(Epoch.Slots, VIRTIO_VGPU_MEMORY_TAG);
+    RtlZeroMemory(&Epoch, sizeof(EPOCH));
+}
+
+// read sections run at dispatch level, so they stay on one processor and may nest
+VOID EpochEnter(PKIRQL OldIrql)
+{
+    PEPOCH_SLOT slot;
+
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+    slot = &Epoch.Slots[KeGetCurrentProcessorNumberEx(NULL)];
+    if (slot->Depth++ == 0)
+    {
+        // publish the epoch before any pointer of the indexes is read
+        InterlockedExchange64(&slot->Epoch, Epoch.GlobalEpoch);
+    }
+}
+
+VOID EpochExit(KIRQL OldIrql)
+{
+    PEPOCH_SLOT slot = &Epoch.Slots[KeGetCurrentProcessorNumberEx(NULL)];
+
+    if (--slot->Depth == 0)
+    {
+        InterlockedExchange64(&slot->Epoch, 0);
+    }
+    KeLowerIrql(OldIrql);
+}
+
+// the oldest epoch a reader may still be in, readers entering later cannot see retired entries
+LONG64 GetOldestEpoch()
+{
+    LONG64 epoch, oldest = MAXLONG64;
+
+    for (ULONG i = 0; i < Epoch.NumSlots; i++)
+    {
+        epoch = Epoch.Slots[i].Epoch;
+        if (epoch != 0 && epoch < oldest)
+        {
+            oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
+// the entry must already be unreachable from the indexes
+VOID EpochRetire(PEPOCH_ENTRY Entry, PEPOCH_FREE_ROUTINE FreeRoutine, PVOID FreeContext)
+{
+    KIRQL savedIrql;
+
+    Entry->FreeRoutine = FreeRoutine;
+    Entry->FreeContext = FreeContext;
+    Entry->Epoch = InterlockedIncrement64(&Epoch.GlobalEpoch);
+
+    SpinLock(&savedIrql, &Epoch.SpinLock);
+    InsertTailList(&Epoch.RetireList, &Entry->Entry);
+    SpinUnLock(savedIrql, &Epoch.SpinLock);
+
+    EpochReclaim(FALSE);
+}
+
+// free the retired entries no reader can see anymore, Wait frees all of them at passive level
+VOID EpochReclaim(BOOLEAN Wait)
+{
+    KIRQL           savedIrql;
+    LONG64          oldest;
+    LIST_ENTRY      freeList;
+    PEPOCH_ENTRY    entry;
+
+    InitializeListHead(&freeList);
+
+    do
+    {
+        oldest = GetOldestEpoch();
+
+        // the list is in retire order, so it is sorted by epoch
+        SpinLock(&savedIrql, &Epoch.SpinLock);
+        while (!IsListEmpty(&Epoch.RetireList))
+        {
+            entry = CONTAINING_RECORD(Epoch.RetireList.Flink, EPOCH_ENTRY, Entry);
+            if (entry->Epoch > oldest)
+            {
+                break;
+            }
+            RemoveEntryListUnsafe(&entry->Entry);
+            InsertTailList(&freeList, &entry->Entry);
+        }
+        SpinUnLock(savedIrql, &Epoch.SpinLock);
+
+        while (!IsListEmpty(&freeList))
+        {
+            entry = CONTAINING_RECORD(RemoveHeadList(&freeList), EPOCH_ENTRY, Entry);
+            entry->FreeRoutine(entry, entry->FreeContext);
+        }
+
+        if (Wait && !IsListEmpty(&Epoch.RetireList))
+        {
+            KeStallExecutionProcessor(10);
+        }
+    } while (Wait && !IsListEmpty(&Epoch.RetireList));
+}
+
+// wait until every reader which might have seen an unlinked entry has left its section
+VOID EpochSynchronize()
+{
+    LONG64 epoch = InterlockedIncrement64(&Epoch.GlobalEpoch);
+
+    while (GetOldestEpoch() < epoch)
+    {
+        KeStallExecutionProcessor(10);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "global.h"
+
+NTSTATUS InitializeEpoch();
+VOID UninitializeEpoch();
+VOID EpochEnter(PKIRQL OldIrql);
+VOID EpochExit(KIRQL OldIrql);
+VOID EpochRetire(PEPOCH_ENTRY Entry, PEPOCH_FREE_ROUTINE FreeRoutine, PVOID FreeContext);
+VOID EpochReclaim(BOOLEAN Wait);
+VOID EpochSynchronize();
+
+// an object found without locks may be dying already, only take a reference while it still has one
+FORCEINLINE BOOLEAN EpochTryReference(LONG volatile* RefCount)
+{
+    LONG count = *RefCount;
+    LONG old;
+
+    while (count > 0)
+    {
+        old = InterlockedCompareExchange(RefCount, count + 1, count);
+        if (old == count)
+        {
+            return TRUE;
+        }
+        count = old;
+    }
+
+    return FALSE;
+}
+
+// readers walk the Flink chain without locks, so an entry is linked only once it is complete
+FORCEINLINE VOID InsertHeadListEpoch(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    InterlockedExchangePointer((PVOID volatile*)&ListHead->Flink, Entry);
+}
+
+// the removed entry keeps its Flink so a reader standing on it can go on, it must be retired
+FORCEINLINE VOID RemoveEntryListEpoch(PLIST_ENTRY Entry)
+{
+    Entry->Flink->Blink = Entry->Blink;
+    InterlockedExchangePointer((PVOID volatile*)&Entry->Blink->Flink, Entry->Flink);
+}
\ No newline at end of file
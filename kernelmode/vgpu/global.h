@@ -19,12 +19,24 @@
 
 #include <osdep.h>
 #include <WDF/VirtIOWdf.h>
+#include <VirtIO.h>
 #include <stdarg.h>
 
 #define SGLIST_SIZE             4
 #define MAX_INTERRUPT_COUNT     4
 #define VIRTIO_VGPU_MEMORY_TAG  ((ULONG)'upgV')
 #define ROUND_UP(x, n)          (((x) + (n) - 1) & (-(n)))
+#define SUBMIT_LATENCY_BUCKETS  24
+#define COMPLETION_BATCH_SIZE   32
+#define COMPLETION_BUDGET       256
+#define MODERATION_WINDOW_MS    10
+#define MODERATION_THRESHOLD    100
+#define POLL_THREAD_IDLE_MS     50
+#define RESOURCE_TABLE_MIN_SIZE 64
+#define RESOURCE_CACHE_MAX_SIZE (32 * 1024 * 1024)
+#define RESOURCE_CACHE_MAX_AGE_MS   1000
+#define RESOURCE_CREATE_BATCH_MAX   256
+#define RESOURCE_RETIRE_BATCH       16
 
 #pragma pack(1)
 struct virtio_vgpu_config {
@@ -36,6 +48,10 @@ struct virtio_vgpu_config {
 };
 #pragma pack()
 
+// capabilities of mvisor vgpu, the low bits are mapped to VIRTGPU_PARAM_*
+#define VIRTIO_VGPU_CAP_CREATE_WITH_BACKING (1ULL << 32)
+#define VIRTIO_VGPU_CAP_TRANSFER_QUEUE      (1ULL << 33)
+
 typedef struct _MEMORY_DESCRIPTOR {
     PVOID               VirtualAddress;
     PHYSICAL_ADDRESS    PhysicalAddress;
@@ -47,16 +63,81 @@ typedef struct _VIRTIO_GPU_DRV_CAPSET {
     ULONG32 max_size;
 }VIRTIO_GPU_DRV_CAPSET, * PVIRTIO_GPU_DRV_CAPSET;
 
+typedef struct _EPOCH_ENTRY* PEPOCH_ENTRY;
+typedef VOID EPOCH_FREE_ROUTINE(PEPOCH_ENTRY Entry, PVOID FreeContext);
+typedef EPOCH_FREE_ROUTINE* PEPOCH_FREE_ROUTINE;
+
+// an object unlinked from a lock-free index, freed once no reader can see it
+typedef struct _EPOCH_ENTRY {
+    LIST_ENTRY              Entry;
+    LONG64                  Epoch;
+    PEPOCH_FREE_ROUTINE     FreeRoutine;
+    PVOID                   FreeContext;
+}EPOCH_ENTRY;
+
+typedef struct _VGPU_QUEUE_STAGE {
+    SLIST_HEADER            StageList;
+    LIST_ENTRY              PendingList;
+    volatile LONG           bDraining;
+}VGPU_QUEUE_STAGE, * PVGPU_QUEUE_STAGE;
+
+typedef struct _VGPU_QUEUE_POLL {
+    KDPC                    Dpc;
+    struct _DEVICE_CONTEXT* Context;
+    ULONG32                 QueueIndex;
+    BOOLEAN                 bPolling;
+    BOOLEAN                 bModerated;
+    ULONG                   RateCount;
+    ULONG64                 RateWindowStart;
+    volatile LONG           bServicing;
+    volatile LONG           bServiceRequested;
+}VGPU_QUEUE_POLL, * PVGPU_QUEUE_POLL;
+
 typedef struct _DEVICE_CONTEXT {
     VIRTIO_WDF_DRIVER       VDevice;
     UINT8                   NumVirtQueues;
     struct virtqueue**      VirtQueues;
     WDFSPINLOCK*            VirtQueueLocks;
+    PVGPU_QUEUE_STAGE       VirtQueueStages;
     WDFINTERRUPT		    WdfInterrupt[MAX_INTERRUPT_COUNT];
     PVOID                   VgpuMemoryAddress;
     LOOKASIDE_LIST_EX       VirglResourceLookAsideList;
     LOOKASIDE_LIST_EX       VgpuBufferLookAsideList;
     ULONG64                 Capabilities;
+    ULONG32                 TransferQueueIndex;
+    LIST_ENTRY              RunList;
+    ULONG                   RunCount;
+    LONG                    InFlightCount;
+    KSPIN_LOCK              SubmitSpinLock;
+    KEVENT                  FenceWaitEvent;
+    PKTHREAD                FenceWaitThread;
+    BOOLEAN                 bFenceWaitStop;
+    volatile LONG64         ExecbufferCount;
+    volatile LONG64         Submit3DCount;
+    volatile LONG64         CommandCount;
+    volatile LONG64         NotifyCount;
+    volatile LONG64         InterruptCount;
+    volatile LONG64         CompletionCount;
+    volatile LONG64         CompletionTime;
+    volatile LONG64         QueueInterruptCount[MAX_INTERRUPT_COUNT];
+    volatile LONG64         QueueDpcCount[MAX_INTERRUPT_COUNT];
+    volatile LONG64         QueueDpcTime[MAX_INTERRUPT_COUNT];
+    volatile LONG64         QueueDpcMaxTime[MAX_INTERRUPT_COUNT];
+    volatile LONG64         QueueModeSwitchCount[MAX_INTERRUPT_COUNT];
+    VGPU_QUEUE_POLL         QueuePolls[MAX_INTERRUPT_COUNT];
+    volatile BOOLEAN        bQueuesReady;
+    SLIST_HEADER            CompletionWorkList;
+    KEVENT                  CompletionWorkEvent;
+    PKTHREAD                CompletionWorkThread;
+    BOOLEAN                 bCompletionWorkStop;
+    volatile LONG           DestroyPendingCount;
+    ULONG                   PollThreadProcessor;
+    PKTHREAD                PollThread;
+    KEVENT                  PollThreadEvent;
+    BOOLEAN                 bPollThreadStop;
+    volatile BOOLEAN        bPollThreadActive;
+    volatile LONG64         PollThreadTime;
+    volatile LONG64         PollThreadBusyTime;
 } DEVICE_CONTEXT, * PDEVICE_CONTEXT;
 
 typedef struct _CAPSETS {
@@ -71,6 +152,7 @@ typedef struct _SHARE_DESCRIPTOR {
     SIZE_T              Size;
     PVOID               UserAdderss;
     PVOID               KernelAddress;
+    MEMORY_CACHING_TYPE CacheType;
 }SHARE_DESCRIPTOR, * PSHARE_DESCRIPTOR;
 
 typedef struct _VGPU_MEMORY_BUFFER {
@@ -79,34 +161,110 @@ typedef struct _VGPU_MEMORY_BUFFER {
     MEMORY_DESCRIPTOR       Memory;
 }VGPU_MEMORY_BUFFER, * PVGPU_MEMORY_BUFFER;
 
+// creation parameters a cached resource must match to be reused
+typedef struct _VIRGL_RESOURCE_KEY {
+    ULONG32             Target;
+    ULONG32             Format;
+    ULONG32             Bind;
+    ULONG32             Width;
+    ULONG32             Height;
+    ULONG32             Depth;
+    ULONG32             ArraySize;
+    ULONG32             LastLevel;
+    ULONG32             NrSamples;
+    ULONG32             Flags;
+    ULONG32             Size;
+}VIRGL_RESOURCE_KEY, * PVIRGL_RESOURCE_KEY;
+
 typedef struct _VIRGL_RESOURCE {
     ULONG32             Id;
+    volatile LONG       RefCount;
     KEVENT              StateEvent;
     LIST_ENTRY          Entry;
     BOOLEAN             bForBuffer;
     BOOLEAN             bForBlob;
-    ULONG64             FenceId;
+    BOOLEAN             bClosed;
+    volatile LONG       InFlightCount;
+    KSPIN_LOCK          StateSpinLock;
     VGPU_MEMORY_BUFFER  Buffer;
+    VIRGL_RESOURCE_KEY  Key;
+    ULONG64             CachedTime;
+    EPOCH_ENTRY         RetireEntry;
 }VIRGL_RESOURCE, * PVIRGL_RESOURCE;
 
+// removed slots keep a tombstone so lock-free probes never stop early
+#define RESOURCE_TABLE_TOMBSTONE    ((PVIRGL_RESOURCE)1)
+
+typedef struct _VIRGL_RESOURCE_TABLE {
+    EPOCH_ENTRY                 RetireEntry;
+    ULONG32                     Size;
+    ULONG32                     UsedCount;
+    PVIRGL_RESOURCE volatile    Slots[ANYSIZE_ARRAY];
+}VIRGL_RESOURCE_TABLE, * PVIRGL_RESOURCE_TABLE;
+
 typedef struct _VIRGL_CONTEXT {
     ULONG32		    Id;
+    volatile LONG   RefCount;
     LIST_ENTRY	    ResourceList; 
     KSPIN_LOCK	    ResourceListSpinLock;
+    PVIRGL_RESOURCE_TABLE volatile ResourceTable;
+    ULONG32             ResourceTableCount;
+    LIST_ENTRY          ResourceCache;
+    SIZE_T              ResourceCacheSize;
+    ULONG               ResourceCacheHits;
+    ULONG               ResourceCacheMisses;
+    LIST_ENTRY          RetireList;
+    ULONG               RetireCount;
     LIST_ENTRY	    Entry;
     PDEVICE_CONTEXT DeviceContext;
+    LIST_ENTRY      SubmitList;
+    KEVENT          SubmitIdleEvent;
+    LIST_ENTRY      RunEntry;
+    ULONG32         QueueIndex;
+    UINT8           Priority;
+    ULONG64         LastServedTime;
+    BOOLEAN         bRunnable;
+    BOOLEAN         bFenceWaiting;
+    LONG            Deficit;
+    LONG            InFlightCount;
+    ULONG           LatencyHistogram[SUBMIT_LATENCY_BUCKETS];
+    struct _VGPU_BUFFER* CoalesceBuffer;
+    KSPIN_LOCK      CoalesceSpinLock;
+    KTIMER          CoalesceTimer;
+    KDPC            CoalesceDpc;
+    volatile LONG   UnfencedInFlightCount;
+    KEVENT          InFlightIdleEvent;
+    volatile LONG   TransferInFlightCount;
+    volatile LONG   WaitSpinBudget;
+    volatile LONG   WaitSpinHits;
+    volatile LONG   WaitSpinMisses;
+    PIO_WORKITEM    DestroyWorkItem;
 }VIRGL_CONTEXT, * PVIRGL_CONTEXT;
 
+typedef struct _FILE_CONTEXT {
+    PVIRGL_CONTEXT  VirglContext;
+}FILE_CONTEXT, * PFILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, GetFileContext);
+
 typedef struct _VGPU_BUFFER {
     PVOID               pBuf;
     PVOID               pRespBuf;
     KEVENT              Event;
     WDFREQUEST          Request;
     PVOID               pDataBuf;
+    PHYSICAL_ADDRESS    DataBufPhysicalAddress;
     SIZE_T              DataBufSize;
     PVOID               ResourceIds;
     SIZE_T              ResourceIdsCount;
     PVOID               FenceObject;
+    PVOID               InFenceObject;
+    LIST_ENTRY          Entry;
+    ULONG64             SubmitTime;
+    SLIST_ENTRY         StageEntry;
+    UINT32              OutNum;
+    UINT32              InNum;
+    struct VirtIOBufferDescriptor Sg[SGLIST_SIZE];
 }VGPU_BUFFER, * PVGPU_BUFFER;
 
 // gloval variables
@@ -19,9 +19,58 @@
 #include "global.h"
 #include "idr.h"
 
+#define BITMAP_FAILED 0xFFFFFFFF
+
 static IDRANDOM Idrs[IDR_MAX_SIZE];
+static RESOURCE_IDR ResourceIdr = { 0 };
+
+NTSTATUS InitializeResourceIdr()
+{
+    ASSERT(!ResourceIdr.Initilaized);
+
+    KeInitializeSpinLock(&ResourceIdr.SpinLock);
+    ResourceIdr.NumCaches = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    ResourceIdr.BitmapBuffer = ExAllocatePool2(POOL_FLAG_NON_PAGED, (RESOURCE_ID_INDEX_MASK + 1) / 8, VIRTIO_VGPU_MEMORY_TAG);
+    ResourceIdr.Generations = ExAllocatePool2(POOL_FLAG_NON_PAGED, (RESOURCE_ID_INDEX_MASK + 1) * sizeof(USHORT), VIRTIO_VGPU_MEMORY_TAG);
+    ResourceIdr.Caches = ExAllocatePool2(POOL_FLAG_NON_PAGED, ResourceIdr.NumCaches * sizeof(RESOURCE_ID_CACHE), VIRTIO_VGPU_MEMORY_TAG);
+    if (!ResourceIdr.BitmapBuffer || !ResourceIdr.Generations || !ResourceIdr.Caches)
+    {
+        VGPU_DEBUG_PRINT("allocate resource idr failed");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlInitializeBitMap(&ResourceIdr.Bitmap, ResourceIdr.BitmapBuffer, RESOURCE_ID_INDEX_MASK + 1);
+    RtlClearAllBits(&ResourceIdr.Bitmap);
+
+    // 0 is reserved for virgl3d in some case
+    RtlSetBit(&ResourceIdr.Bitmap, 0);
+    ResourceIdr.LastFreeIndex = 1;
+    ResourceIdr.Initilaized = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+VOID UnInitializeResourceIdr()
+{
+    if (ResourceIdr.BitmapBuffer)
+    {
+        ExFreePoolWithTag(ResourceIdr.BitmapBuffer, VIRTIO_VGPU_MEMORY_TAG);
+    }
+
+    if (ResourceIdr.Generations)
+    {
+        ExFreePoolWithTag(ResourceIdr.Generations, VIRTIO_VGPU_MEMORY_TAG);
+    }
+
+    if (ResourceIdr.Caches)
+    {
+        ExFreePoolWithTag(ResourceIdr.Caches, VIRTIO_VGPU_MEMORY_TAG);
+    }
+
+    RtlZeroMemory(&ResourceIdr, sizeof(RESOURCE_IDR));
+}
 
-VOID InitializeIdr()
+NTSTATUS InitializeIdr()
 {
     for (size_t i = 0; i < ARRAYSIZE(Idrs); i++)
     {
@@ -29,22 +78,13 @@ VOID InitializeIdr()
 
         RtlZeroMemory(&Idrs[i], sizeof(IDRANDOM));
         KeInitializeSpinLock(&Idrs[i].SpinLock);
-        InitializeListHead(&Idrs[i].FreeIdList);
-        ExInitializeLookasideListEx(
-            &Idrs[i].LookAsideList,
-            NULL,
-            NULL,
-            NonPagedPool,
-            0,
-            sizeof(FREEID),
-            VIRTIO_VGPU_MEMORY_TAG,
-            0
-        );
 
         // 0 is reserved for virgl3d in some case
         Idrs[i].Id.QuadPart = 1;
         Idrs[i].Initilaized = TRUE;
     }
+
+    return InitializeResourceIdr();
 }
 
 VOID UnInitializeIdr()
@@ -52,14 +92,10 @@ VOID UnInitializeIdr()
     for (size_t i = 0; i < ARRAYSIZE(Idrs); i++)
     {
         ASSERT(Idrs[i].Initilaized);
-        while (!IsListEmpty(&Idrs[i].FreeIdList)) {
-            PLIST_ENTRY item = RemoveHeadList(&Idrs[i].FreeIdList);
-            PFREEID freeId = CONTAINING_RECORD(item, FREEID, Entry);
-            ExFreeToLookasideListEx(&Idrs[i].LookAsideList, freeId);
-        }
-        ExDeleteLookasideListEx(&Idrs[i].LookAsideList);
         Idrs[i].Initilaized = FALSE;
     }
+
+    UnInitializeResourceIdr();
 }
 
 VOID GetIdFromIdrWithoutCache(UINT8 type, PVOID Id, SIZE_T Size)
@@ -73,35 +109,75 @@ VOID GetIdFromIdrWithoutCache(UINT8 type, PVOID Id, SIZE_T Size)
     SpinUnLock(savedIrql, &Idrs[type].SpinLock);
 }
 
-VOID GetIdFromIdr(UINT8 type, PVOID Id, SIZE_T Size)
+BOOLEAN GetResourceIdFromIdr(PULONG32 Id)
 {
-    ASSERT(Idrs[type].Initilaized);
+    ASSERT(ResourceIdr.Initilaized);
 
-    KIRQL savedIrql;
-    SpinLock(&savedIrql, &Idrs[type].SpinLock);
-    if (IsListEmpty(&Idrs[type].FreeIdList))
+    KIRQL               oldIrql;
+    ULONG               index;
+    PRESOURCE_ID_CACHE  cache;
+
+    // the cache of a processor is only touched at dispatch level on that processor
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    cache = &ResourceIdr.Caches[KeGetCurrentProcessorNumberEx(NULL)];
+    if (cache->Count == 0)
     {
-        RtlCopyMemory(Id, &Idrs[type].Id, Size);
-        Idrs[type].Id.QuadPart++;
+        // refill half of the cache so frees on this processor still find room
+        KeAcquireSpinLockAtDpcLevel(&ResourceIdr.SpinLock);
+        while (cache->Count < RESOURCE_ID_CACHE_SIZE / 2)
+        {
+            index = RtlFindClearBitsAndSet(&ResourceIdr.Bitmap, 1, ResourceIdr.LastFreeIndex);
+            if (index == BITMAP_FAILED)
+            {
+                break;
+            }
+            ResourceIdr.LastFreeIndex = index + 1;
+            cache->Indexes[cache->Count++] = index;
+        }
+        KeReleaseSpinLockFromDpcLevel(&ResourceIdr.SpinLock);
     }
-    else
+
+    if (cache->Count == 0)
     {
-        PLIST_ENTRY item = RemoveHeadList(&Idrs[type].FreeIdList);
-        PFREEID freeId = CONTAINING_RECORD(item, FREEID, Entry);
-        RtlCopyMemory(Id, &freeId->Id, Size);
-        ExFreeToLookasideListEx(&Idrs[type].LookAsideList, freeId);
+        KeLowerIrql(oldIrql);
+        VGPU_DEBUG_PRINT("resource ids exhausted");
+        return FALSE;
     }
-    SpinUnLock(savedIrql, &Idrs[type].SpinLock);
+
+    index = cache->Indexes[--cache->Count];
+    KeLowerIrql(oldIrql);
+
+    *Id = ((ULONG32)ResourceIdr.Generations[index] << RESOURCE_ID_INDEX_BITS) | index;
+    return TRUE;
 }
 
-VOID PutIdToIdr(UINT8 type, PVOID Id, SIZE_T Size)
+// only called once the host has completed the unref of the resource
+VOID PutResourceIdToIdr(ULONG32 Id)
 {
-    ASSERT(Idrs[type].Initilaized);
+    ASSERT(ResourceIdr.Initilaized);
 
-    PFREEID freeId = ExAllocateFromLookasideListEx(&Idrs[type].LookAsideList);
-    ASSERT(freeId != NULL);
+    KIRQL               oldIrql;
+    ULONG               index = Id & RESOURCE_ID_INDEX_MASK;
+    PRESOURCE_ID_CACHE  cache;
 
-    freeId->Id.QuadPart = 0;
-    RtlCopyMemory(&freeId->Id, Id, Size);
-    ExInterlockedInsertHeadList(&Idrs[type].FreeIdList, &freeId->Entry, &Idrs[type].SpinLock);
-}
+    // the next owner of the index gets a new id, so nothing stale on the host can alias it
+    ResourceIdr.Generations[index] = (USHORT)((ResourceIdr.Generations[index] + 1) & RESOURCE_ID_GENERATION_MASK);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    cache = &ResourceIdr.Caches[KeGetCurrentProcessorNumberEx(NULL)];
+    if (cache->Count < RESOURCE_ID_CACHE_SIZE)
+    {
+        cache->Indexes[cache->Count++] = index;
+    }
+    else
+    {
+        KeAcquireSpinLockAtDpcLevel(&ResourceIdr.SpinLock);
+        RtlClearBit(&ResourceIdr.Bitmap, index);
+        if (index < ResourceIdr.LastFreeIndex)
+        {
+            ResourceIdr.LastFreeIndex = index;
+        }
+        KeReleaseSpinLockFromDpcLevel(&ResourceIdr.SpinLock);
+    }
+    KeLowerIrql(oldIrql);
+}
\ No newline at end of file
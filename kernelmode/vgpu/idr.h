@@ -17,25 +17,40 @@
  */
 #pragma once
 
-typedef struct _FREEID {
-    LARGE_INTEGER   Id;
-    LIST_ENTRY      Entry;
-}FREEID, * PFREEID;
-
 typedef struct _IDRANDOM {
     LARGE_INTEGER           Id;
     KSPIN_LOCK	            SpinLock;
-    LIST_ENTRY	            FreeIdList;
     BOOLEAN                 Initilaized;
-    LOOKASIDE_LIST_EX       LookAsideList;
 }IDRANDOM, * PIDRANDOM;
 
-#define VIRGL_RESOURCE_ID_TYPE      0
-#define FENCE_ID_TYPE               1
+// resource ids are an index into a bitmap tagged with the generation of the index
+#define RESOURCE_ID_INDEX_BITS      18
+#define RESOURCE_ID_INDEX_MASK      ((1UL << RESOURCE_ID_INDEX_BITS) - 1)
+#define RESOURCE_ID_GENERATION_MASK ((1UL << (32 - RESOURCE_ID_INDEX_BITS)) - 1)
+#define RESOURCE_ID_CACHE_SIZE      16
+
+typedef struct _RESOURCE_ID_CACHE {
+    ULONG32                 Count;
+    ULONG32                 Indexes[RESOURCE_ID_CACHE_SIZE];
+}RESOURCE_ID_CACHE, * PRESOURCE_ID_CACHE;
+
+typedef struct _RESOURCE_IDR {
+    KSPIN_LOCK              SpinLock;
+    RTL_BITMAP              Bitmap;
+    PULONG                  BitmapBuffer;
+    PUSHORT                 Generations;
+    ULONG                   LastFreeIndex;
+    ULONG                   NumCaches;
+    PRESOURCE_ID_CACHE      Caches;
+    BOOLEAN                 Initilaized;
+}RESOURCE_IDR, * PRESOURCE_IDR;
+
+#define FENCE_ID_TYPE               0
+#define VIRGL_CONTEXT_ID_TYPE       1
 #define IDR_MAX_SIZE                2
 
-VOID InitializeIdr();
+NTSTATUS InitializeIdr();
 VOID UnInitializeIdr();
 VOID GetIdFromIdrWithoutCache(UINT8 type, PVOID Id, SIZE_T Size);
-VOID GetIdFromIdr(UINT8 type, PVOID Id, SIZE_T Size);
-VOID PutIdToIdr(UINT8 type, PVOID Id, SIZE_T Size);
\ No newline at end of file
+BOOLEAN GetResourceIdFromIdr(PULONG32 Id);
+VOID PutResourceIdToIdr(ULONG32 Id);
\ No newline at end of file
@@ -84,6 +84,16 @@ DEFINE_GUID(GUID_DEVINTERFACE_VGPU, 0x31c22912, 0x7210, 0x11ed, 0xbf, 0x22, 0xbc
     METHOD_OUT_DIRECT, \
     FILE_ANY_ACCESS)
 
+#define IOCTL_VIRTIO_VGPU_CONTEXT_SET_PARAM CTL_CODE(FILE_DEVICE_UNKNOWN, \
+    0x812, \
+    METHOD_IN_DIRECT, \
+    FILE_ANY_ACCESS)
+
+#define IOCTL_VIRTIO_VGPU_RESOURCE_CREATE_BATCH CTL_CODE(FILE_DEVICE_UNKNOWN, \
+    0x813, \
+    METHOD_OUT_DIRECT, \
+    FILE_ANY_ACCESS)
+
 #define VIRTGPU_PARAM_3D_FEATURES           1 /* do we have 3D features in the hw */
 #define VIRTGPU_PARAM_CAPSET_QUERY_FIX      2 /* do we have the capset fix */
 #define VIRTGPU_PARAM_RESOURCE_BLOB         3 /* DRM_VIRTGPU_RESOURCE_CREATE_BLOB */
@@ -92,6 +102,30 @@ DEFINE_GUID(GUID_DEVINTERFACE_VGPU, 0x31c22912, 0x7210, 0x11ed, 0xbf, 0x22, 0xbc
 #define VIRTGPU_PARAM_CONTEXT_INIT          6 /* DRM_VIRTGPU_CONTEXT_INIT */
 #define VIRTGPU_PARAM_SUPPORTED_CAPSET_IDs  7 /* Bitmask of supported capability set ids */
 
+/* private params of mvisor vgpu */
+#define VIRTGPU_PARAM_STAGING               0x1000 /* staging config of the device */
+#define VIRTGPU_PARAM_EXECBUFFER_COUNT      0x1001 /* execbuffers submitted by user mode */
+#define VIRTGPU_PARAM_SUBMIT_3D_COUNT       0x1002 /* SUBMIT_3D commands sent to the host */
+#define VIRTGPU_PARAM_SUBMIT_LATENCY_P50    0x1003 /* submit latency percentiles of the caller in us */
+#define VIRTGPU_PARAM_SUBMIT_LATENCY_P90    0x1004
+#define VIRTGPU_PARAM_SUBMIT_LATENCY_P99    0x1005
+#define VIRTGPU_PARAM_COMMAND_COUNT         0x1006 /* commands published to the virtqueues */
+#define VIRTGPU_PARAM_NOTIFY_COUNT          0x1007 /* queue notifications, each one is a vm exit */
+#define VIRTGPU_PARAM_INTERRUPT_COUNT       0x1008 /* interrupts raised by the device */
+#define VIRTGPU_PARAM_COMPLETION_COUNT      0x1009 /* completions read by the dpc */
+#define VIRTGPU_PARAM_COMPLETION_TIME       0x100A /* time spent reading completions in us */
+#define VIRTGPU_PARAM_WAIT_SPIN_HITS        0x100B /* waits of the caller finished by spinning */
+#define VIRTGPU_PARAM_WAIT_SPIN_MISSES      0x100C /* waits of the caller which blocked after spinning */
+#define VIRTGPU_PARAM_POLL_THREAD_TIME      0x100D /* time the polling thread spent polling in us */
+#define VIRTGPU_PARAM_POLL_THREAD_BUSY_TIME 0x100E /* part of it which found completions */
+#define VIRTGPU_PARAM_RESOURCE_CACHE_HITS   0x100F /* resources of the caller created from its cache */
+#define VIRTGPU_PARAM_RESOURCE_CACHE_MISSES 0x1010 /* resources of the caller created on the host */
+#define VIRTGPU_PARAM_QUEUE_INTERRUPT_COUNT 0x1100 /* + queue index, interrupts of the queue */
+#define VIRTGPU_PARAM_QUEUE_DPC_COUNT       0x1200 /* + queue index, dpcs of the queue */
+#define VIRTGPU_PARAM_QUEUE_DPC_TIME        0x1300 /* + queue index, time spent in the dpcs of the queue in us */
+#define VIRTGPU_PARAM_QUEUE_DPC_MAX_TIME    0x1400 /* + queue index, longest dpc of the queue in us */
+#define VIRTGPU_PARAM_QUEUE_MODE_SWITCHES   0x1500 /* + queue index, switches between interrupt/poll and moderation modes */
+
 #define VIRTGPU_EXECBUF_FENCE_FD_IN	0x01
 #define VIRTGPU_EXECBUF_FENCE_FD_OUT	0x02
 #define VIRTGPU_EXECBUF_RING_IDX	0x04
@@ -219,6 +253,11 @@ struct drm_virtgpu_3d_transfer {
 #define VIRTGPU_CONTEXT_PARAM_CAPSET_ID       0x0001
 #define VIRTGPU_CONTEXT_PARAM_NUM_RINGS       0x0002
 #define VIRTGPU_CONTEXT_PARAM_POLL_RINGS_MASK 0x0003
+#define VIRTGPU_CONTEXT_PARAM_PRIORITY        0x1000 /* mvisor vgpu, one of VIRTGPU_CONTEXT_PRIORITY_* */
+
+#define VIRTGPU_CONTEXT_PRIORITY_BATCH        0
+#define VIRTGPU_CONTEXT_PRIORITY_NORMAL       1
+#define VIRTGPU_CONTEXT_PRIORITY_INTERACTIVE  2
 struct drm_virtgpu_context_set_param {
     __u64 param;
     __u64 value;
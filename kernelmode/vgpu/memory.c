@@ -143,6 +143,66 @@ VOID FreeVgpuMemory(PVOID VitrualAddress, SIZE_T Size)
     VGPU_DEBUG_LOG("VGPU available memory size=0x%llx", VgpuMemory.AvailableMemorySize);
 }
 
+VOID FreeVgpuMemoryRuns(PVGPU_MEMORY_RUN Runs, ULONG Count)
+{
+    KIRQL           savedIrql;
+    ULONG           i, j, index, page, numMerged = 0;
+    VGPU_MEMORY_RUN run;
+
+    ASSERT(VgpuMemory.bInitialize);
+
+    if (Count == 0)
+    {
+        return;
+    }
+
+    // sort by address and merge the adjacent runs, the pool is allocated like a ring
+    for (i = 1; i < Count; i++)
+    {
+        run = Runs[i];
+        for (j = i; j > 0 && (PUINT8)Runs[j - 1].VirtualAddress > (PUINT8)run.VirtualAddress; j--)
+        {
+            Runs[j] = Runs[j - 1];
+        }
+        Runs[j] = run;
+    }
+
+    for (i = 1; i < Count; i++)
+    {
+        if ((PUINT8)Runs[numMerged].VirtualAddress + Runs[numMerged].Size == (PUINT8)Runs[i].VirtualAddress)
+        {
+            Runs[numMerged].Size += Runs[i].Size;
+        }
+        else
+        {
+            Runs[++numMerged] = Runs[i];
+        }
+    }
+    numMerged++;
+
+    // start processing
+    SpinLock(&savedIrql, &VgpuMemory.SpinLock);
+
+    for (i = 0; i < numMerged; i++)
+    {
+        index = (ULONG)(((PUINT8)Runs[i].VirtualAddress - VgpuMemory.VirtualAddress) / PAGE_SIZE);
+        page = (ULONG)(Runs[i].Size / PAGE_SIZE);
+
+        if (!RtlAreBitsSet(&VgpuMemory.RegionBitmap, index, page))
+        {
+            VGPU_DEBUG_PRINT("WRONG: can't find the bits to free");
+            continue;
+        }
+
+        RtlClearBits(&VgpuMemory.RegionBitmap, index, page);
+        VgpuMemory.AvailableMemorySize += Runs[i].Size;
+    }
+    VgpuMemory.LastFreeIndex = (ULONG)(((PUINT8)Runs[0].VirtualAddress - VgpuMemory.VirtualAddress) / PAGE_SIZE);
+
+    // end processing
+    SpinUnLock(savedIrql, &VgpuMemory.SpinLock);
+}
+
 BOOLEAN ReallocVgpuMemory(PVOID VitrualAddress, SIZE_T OriginSize, SIZE_T TargetSize)
 {
     KIRQL   savedIrql;
@@ -21,6 +21,12 @@
 
 VOID InitializeVgpuMemory(PVOID VitrualAddress, PHYSICAL_ADDRESS PhysicalAddress, SIZE_T Size);
 VOID UninitializeVgpuMemory();
+typedef struct _VGPU_MEMORY_RUN {
+    PVOID   VirtualAddress;
+    SIZE_T  Size;
+}VGPU_MEMORY_RUN, * PVGPU_MEMORY_RUN;
+
 VOID FreeVgpuMemory(PVOID VitrualAddress, SIZE_T Size);
+VOID FreeVgpuMemoryRuns(PVGPU_MEMORY_RUN Runs, ULONG Count);
 BOOLEAN ReallocVgpuMemory(PVOID VitrualAddress, SIZE_T OriginSize, SIZE_T TargetSize);
 BOOLEAN AllocateVgpuMemory(SIZE_T Size, PMEMORY_DESCRIPTOR Memory);
\ No newline at end of file
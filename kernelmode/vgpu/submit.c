@@ -0,0 +1,914 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "control.h"
+#include "command.h"
+#include "memory.h"
+#include "submit.h"
+#include "worker.h"
+
+// more contexts wait for fences than one wait can take, the ones left out get their turn after this
+#define FENCE_WAIT_ROTATE_MS        10
+
+// small unfenced execbuffers are merged while the context still has a submission in flight
+#define COALESCE_BUFFER_SIZE        (16 * PAGE_SIZE)
+#define COALESCE_MAX_COMMAND_SIZE   (2 * PAGE_SIZE)
+#define COALESCE_WINDOW_US          500
+
+// deficit round robin between contexts, the cost of a submission is its size in bytes
+#define SCHEDULE_QUANTUM                (16 * PAGE_SIZE)
+#define SCHEDULE_MAX_IN_FLIGHT          16
+#define SCHEDULE_MAX_CONTEXT_IN_FLIGHT  4
+
+// a runnable context which wasn't served for this long is scheduled as interactive
+#define SCHEDULE_STARVATION_TIME_MS     100
+
+// completed submissions with more resources than this wake their waiters at passive level
+#define COMPLETION_WORK_RESOURCE_IDS    64
+
+// a wait spins for up to this many microseconds before blocking, tuned per context
+#define WAIT_SPIN_MIN_US                2
+#define WAIT_SPIN_INITIAL_US            20
+#define WAIT_SPIN_MAX_US                100
+
+
+FORCEINLINE VOID ReleaseInFence(PVGPU_BUFFER Buffer)
+{
+    ObDereferenceObject(Buffer->InFenceObject);
+    Buffer->InFenceObject = NULL;
+}
+
+// a signal taken by the fence waiter already released the in fence of the submission
+FORCEINLINE BOOLEAN IsInFenceSignaled(PVGPU_BUFFER Buffer)
+{
+    if (Buffer->InFenceObject == NULL)
+    {
+        return TRUE;
+    }
+
+    if (KeReadStateEvent(Buffer->InFenceObject) == 0)
+    {
+        return FALSE;
+    }
+
+    ReleaseInFence(Buffer);
+    return TRUE;
+}
+
+FORCEINLINE BOOLEAN IsSubmitFenced(PVGPU_BUFFER Buffer)
+{
+    return (((struct virtio_gpu_ctrl_hdr*)Buffer->pBuf)->flags & VIRTIO_GPU_FLAG_FENCE) != 0;
+}
+
+FORCEINLINE BOOLEAN IsTransferCommand(PVGPU_BUFFER Buffer)
+{
+    UINT32 type = ((struct virtio_gpu_ctrl_hdr*)Buffer->pBuf)->type;
+    return type == VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D || type == VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D;
+}
+
+FORCEINLINE UINT8 GetEffectivePriority(PVIRGL_CONTEXT VirglContext, ULONG64 Now)
+{
+    if (Now - VirglContext->LastServedTime > SCHEDULE_STARVATION_TIME_MS * 10000ULL)
+    {
+        return VIRTGPU_CONTEXT_PRIORITY_INTERACTIVE;
+    }
+
+    return VirglContext->Priority;
+}
+
+FORCEINLINE LONG GetSubmitCost(PVGPU_BUFFER Buffer)
+{
+    if (IsTransferCommand(Buffer))
+    {
+        return sizeof(struct virtio_gpu_transfer_host_3d);
+    }
+
+    return (LONG)(sizeof(struct virtio_gpu_cmd_submit) + ((struct virtio_gpu_cmd_submit*)Buffer->pBuf)->size);
+}
+
+// caller must hold the SubmitSpinLock of the device
+BOOLEAN PushScheduledCommandUnsafe(PVIRGL_CONTEXT VirglContext, PVGPU_BUFFER Buffer)
+{
+    PDEVICE_CONTEXT context = VirglContext->DeviceContext;
+
+    if (IsTransferCommand(Buffer))
+    {
+        // counted before the lock is dropped, so no later submission of the context can overtake the transfer
+        if (context->TransferQueueIndex != COMMAND_QUEUE)
+        {
+            InterlockedIncrement(&VirglContext->TransferInFlightCount);
+        }
+
+        if (!NT_SUCCESS(PushTransferCommand(context, Buffer)))
+        {
+            if (context->TransferQueueIndex != COMMAND_QUEUE)
+            {
+                InterlockedDecrement(&VirglContext->TransferInFlightCount);
+            }
+            InsertHeadList(&VirglContext->SubmitList, &Buffer->Entry);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    // the device was stopped and the submission never reached the host, keep it at the head to retry on the next schedule
+    if (!NT_SUCCESS(PushSubmitCommand(context, Buffer)))
+    {
+        InsertHeadList(&VirglContext->SubmitList, &Buffer->Entry);
+        return FALSE;
+    }
+
+    context->InFlightCount++;
+    VirglContext->InFlightCount++;
+    KeClearEvent(&VirglContext->InFlightIdleEvent);
+
+    // fenced submissions are completed by the host after the gpu work, the coalescing only counts the others
+    if (!IsSubmitFenced(Buffer))
+    {
+        InterlockedIncrement(&VirglContext->UnfencedInFlightCount);
+    }
+
+    return TRUE;
+}
+
+// serve one context of the run list, returns FALSE if the context is blocked now
+BOOLEAN ServeVirglContextUnsafe(PVIRGL_CONTEXT VirglContext, PBOOLEAN WakeFenceWaiter)
+{
+    PVGPU_BUFFER    buffer;
+    PDEVICE_CONTEXT context = VirglContext->DeviceContext;
+
+    buffer = CONTAINING_RECORD(VirglContext->SubmitList.Flink, VGPU_BUFFER, Entry);
+    if (!IsInFenceSignaled(buffer))
+    {
+        if (!VirglContext->bFenceWaiting)
+        {
+            VirglContext->bFenceWaiting = TRUE;
+            *WakeFenceWaiter = TRUE;
+        }
+        return FALSE;
+    }
+
+    VirglContext->bFenceWaiting = FALSE;
+
+    // submissions after a transfer on the transfer queue wait for its completion
+    if (VirglContext->InFlightCount >= SCHEDULE_MAX_CONTEXT_IN_FLIGHT || VirglContext->TransferInFlightCount > 0)
+    {
+        return FALSE;
+    }
+
+    VirglContext->Deficit += SCHEDULE_QUANTUM;
+
+    while (context->InFlightCount < SCHEDULE_MAX_IN_FLIGHT && VirglContext->InFlightCount < SCHEDULE_MAX_CONTEXT_IN_FLIGHT)
+    {
+        if (GetSubmitCost(buffer) > VirglContext->Deficit)
+        {
+            break;
+        }
+
+        // the transfer queue gives no order against the submissions, hold the transfer until they completed
+        if (IsTransferCommand(buffer) && context->TransferQueueIndex != COMMAND_QUEUE && VirglContext->InFlightCount > 0)
+        {
+            return FALSE;
+        }
+
+        RemoveEntryListUnsafe(&buffer->Entry);
+        if (!PushScheduledCommandUnsafe(VirglContext, buffer))
+        {
+            return FALSE;
+        }
+
+        VirglContext->Deficit -= GetSubmitCost(buffer);
+        VirglContext->LastServedTime = KeQueryInterruptTime();
+
+        if (IsListEmpty(&VirglContext->SubmitList) || VirglContext->TransferInFlightCount > 0)
+        {
+            break;
+        }
+
+        buffer = CONTAINING_RECORD(VirglContext->SubmitList.Flink, VGPU_BUFFER, Entry);
+        if (!IsInFenceSignaled(buffer))
+        {
+            break;
+        }
+    }
+
+    // a large submission may need the quantum of several rounds
+    return TRUE;
+}
+
+// caller must hold the SubmitSpinLock of the device
+BOOLEAN ScheduleSubmitCommandsUnsafe(PDEVICE_CONTEXT Context)
+{
+    ULONG           count;
+    INT             priority;
+    ULONG64         now = KeQueryInterruptTime();
+    BOOLEAN         bServed;
+    BOOLEAN         bWakeFenceWaiter = FALSE;
+    PLIST_ENTRY     item;
+    PVIRGL_CONTEXT  virglContext;
+
+    // serve the higher priorities first, starved contexts are boosted to interactive
+    for (priority = VIRTGPU_CONTEXT_PRIORITY_INTERACTIVE; priority >= VIRTGPU_CONTEXT_PRIORITY_BATCH; priority--)
+    {
+        // one pass visits every runnable context once and moves it to the tail,
+        // stop when no context of this priority can make progress
+        bServed = TRUE;
+        while (bServed && Context->RunCount > 0 && Context->InFlightCount < SCHEDULE_MAX_IN_FLIGHT)
+        {
+            bServed = FALSE;
+
+            for (count = Context->RunCount; count > 0 && Context->InFlightCount < SCHEDULE_MAX_IN_FLIGHT; count--)
+            {
+                virglContext = CONTAINING_RECORD(RemoveHeadList(&Context->RunList), VIRGL_CONTEXT, RunEntry);
+                if (GetEffectivePriority(virglContext, now) == priority)
+                {
+                    bServed |= ServeVirglContextUnsafe(virglContext, &bWakeFenceWaiter);
+                }
+
+                if (IsListEmpty(&virglContext->SubmitList))
+                {
+                    virglContext->Deficit = 0;
+                    virglContext->bRunnable = FALSE;
+                    Context->RunCount--;
+                    KeSetEvent(&virglContext->SubmitIdleEvent, IO_NO_INCREMENT, FALSE);
+                }
+                else
+                {
+                    InsertTailList(&Context->RunList, &virglContext->RunEntry);
+                }
+            }
+        }
+    }
+
+    return bWakeFenceWaiter;
+}
+
+VOID ScheduleSubmitCommands(PDEVICE_CONTEXT Context)
+{
+    KIRQL   savedIrql;
+    BOOLEAN bWakeFenceWaiter;
+
+    SpinLock(&savedIrql, &Context->SubmitSpinLock);
+    bWakeFenceWaiter = ScheduleSubmitCommandsUnsafe(Context);
+    SpinUnLock(savedIrql, &Context->SubmitSpinLock);
+
+    // let the fence waiter pick up the new dependency
+    if (bWakeFenceWaiter)
+    {
+        KeSetEvent(&Context->FenceWaitEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+VOID SetVirglContextPriority(PVIRGL_CONTEXT VirglContext, UINT8 Priority)
+{
+    KIRQL savedIrql;
+
+    SpinLock(&savedIrql, &VirglContext->DeviceContext->SubmitSpinLock);
+    VirglContext->Priority = Priority;
+    SpinUnLock(savedIrql, &VirglContext->DeviceContext->SubmitSpinLock);
+
+    ScheduleSubmitCommands(VirglContext->DeviceContext);
+}
+
+VOID FenceWaitRoutine(PVOID StartContext)
+{
+    NTSTATUS        status;
+    KIRQL           savedIrql;
+    ULONG           count, index, waiting, skip = 0;
+    BOOLEAN         bTruncated;
+    PLIST_ENTRY     item;
+    PVIRGL_CONTEXT  virglContext;
+    PVGPU_BUFFER    buffer;
+    PKWAIT_BLOCK    waitBlocks;
+    LARGE_INTEGER   timeout;
+    PVOID           waitObjects[MAXIMUM_WAIT_OBJECTS];
+    PVGPU_BUFFER    waitBuffers[MAXIMUM_WAIT_OBJECTS];
+    PDEVICE_CONTEXT context = StartContext;
+
+    waitBlocks = ExAllocatePool2(POOL_FLAG_NON_PAGED, MAXIMUM_WAIT_OBJECTS * sizeof(KWAIT_BLOCK), VIRTIO_VGPU_MEMORY_TAG);
+    ASSERT(waitBlocks != NULL);
+
+    while (!context->bFenceWaitStop)
+    {
+        // the first object wakes up the waiter whenever the set of fences to wait for has changed
+        count = 0;
+        waitObjects[count] = &context->FenceWaitEvent;
+        waitBuffers[count++] = NULL;
+        bTruncated = FALSE;
+
+        SpinLock(&savedIrql, &context->SubmitSpinLock);
+        for (ULONG pass = 0; pass < 2; pass++)
+        {
+            // start behind the contexts which had their turn when not all fences fit into one wait
+            waiting = 0;
+            for (item = context->RunList.Flink; item != &context->RunList; item = item->Flink)
+            {
+                virglContext = CONTAINING_RECORD(item, VIRGL_CONTEXT, RunEntry);
+                buffer = CONTAINING_RECORD(virglContext->SubmitList.Flink, VGPU_BUFFER, Entry);
+                if (!virglContext->bFenceWaiting || !buffer->InFenceObject)
+                {
+                    continue;
+                }
+
+                index = waiting++;
+                if ((pass == 0) != (index >= skip))
+                {
+                    continue;
+                }
+
+                if (count == MAXIMUM_WAIT_OBJECTS)
+                {
+                    bTruncated = TRUE;
+                    continue;
+                }
+
+                // keep the fence alive while we are waiting for it without any lock
+                ObReferenceObject(buffer->InFenceObject);
+                waitObjects[count] = buffer->InFenceObject;
+                waitBuffers[count++] = buffer;
+            }
+        }
+        SpinUnLock(savedIrql, &context->SubmitSpinLock);
+
+        // only the contexts left out of a full wait need to be looked at again without a signal
+        skip = bTruncated ? (skip + count - 1) % waiting : 0;
+        timeout.QuadPart = -10000LL * FENCE_WAIT_ROTATE_MS;
+        status = KeWaitForMultipleObjects(count, waitObjects, WaitAny, Executive, KernelMode, FALSE, bTruncated ? &timeout : NULL, waitBlocks);
+
+        SpinLock(&savedIrql, &context->SubmitSpinLock);
+        if (status > STATUS_WAIT_0 && status < (NTSTATUS)(STATUS_WAIT_0 + count))
+        {
+            // the wait took the signal of this fence for the submission it was armed for, an auto-reset
+            // event doesn't show it anymore, so the submission is released here if it still waits for it
+            index = status - STATUS_WAIT_0;
+            for (item = context->RunList.Flink; item != &context->RunList; item = item->Flink)
+            {
+                virglContext = CONTAINING_RECORD(item, VIRGL_CONTEXT, RunEntry);
+                buffer = CONTAINING_RECORD(virglContext->SubmitList.Flink, VGPU_BUFFER, Entry);
+                if (buffer == waitBuffers[index] && buffer->InFenceObject == waitObjects[index])
+                {
+                    ReleaseInFence(buffer);
+                    break;
+                }
+            }
+        }
+
+        // a context found blocked by the schedule is picked up by the next round anyway
+        ScheduleSubmitCommandsUnsafe(context);
+        SpinUnLock(savedIrql, &context->SubmitSpinLock);
+
+        for (ULONG i = 1; i < count; i++)
+        {
+            ObDereferenceObject(waitObjects[i]);
+        }
+    }
+
+    ExFreePoolWithTag(waitBlocks, VIRTIO_VGPU_MEMORY_TAG);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS InitializeScheduler(PDEVICE_CONTEXT Context)
+{
+    NTSTATUS    status;
+    HANDLE      threadHandle;
+
+    InitializeListHead(&Context->RunList);
+    KeInitializeSpinLock(&Context->SubmitSpinLock);
+    KeInitializeEvent(&Context->FenceWaitEvent, SynchronizationEvent, FALSE);
+    Context->RunCount = 0;
+    Context->InFlightCount = 0;
+    Context->bFenceWaitStop = FALSE;
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, FenceWaitRoutine, Context);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("PsCreateSystemThread failed status=0x%08x", status);
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, NULL, KernelMode, &Context->FenceWaitThread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("ObReferenceObjectByHandle failed status=0x%08x", status);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID UninitializeScheduler(PDEVICE_CONTEXT Context)
+{
+    if (!Context->FenceWaitThread)
+    {
+        return;
+    }
+
+    Context->bFenceWaitStop = TRUE;
+    KeSetEvent(&Context->FenceWaitEvent, IO_NO_INCREMENT, FALSE);
+
+    KeWaitForSingleObject(Context->FenceWaitThread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Context->FenceWaitThread);
+    Context->FenceWaitThread = NULL;
+}
+
+VOID InitializeSubmitList(PVIRGL_CONTEXT VirglContext)
+{
+    InitializeListHead(&VirglContext->SubmitList);
+    KeInitializeEvent(&VirglContext->SubmitIdleEvent, NotificationEvent, TRUE);
+    KeInitializeEvent(&VirglContext->InFlightIdleEvent, NotificationEvent, TRUE);
+    VirglContext->TransferInFlightCount = 0;
+    VirglContext->WaitSpinBudget = WAIT_SPIN_INITIAL_US;
+    VirglContext->WaitSpinHits = 0;
+    VirglContext->WaitSpinMisses = 0;
+    VirglContext->bRunnable = FALSE;
+    VirglContext->bFenceWaiting = FALSE;
+    VirglContext->Deficit = 0;
+    VirglContext->InFlightCount = 0;
+    RtlZeroMemory(VirglContext->LatencyHistogram, sizeof(VirglContext->LatencyHistogram));
+}
+
+VOID RetireSubmitCommand(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer)
+{
+    struct virtio_gpu_ctrl_hdr* header = (struct virtio_gpu_ctrl_hdr*)Buffer->pBuf;
+
+    // a dropped transfer only holds its resource busy
+    if (IsTransferCommand(Buffer))
+    {
+        KIRQL oldIrql;
+        EpochEnter(&oldIrql);
+        PVIRGL_CONTEXT virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
+        if (virglContext)
+        {
+            UpdateResourceState(virglContext, &((struct virtio_gpu_transfer_host_3d*)Buffer->pBuf)->resource_id, 1, FALSE);
+        }
+        EpochExit(oldIrql);
+        FreeCommandBuffer(Context, Buffer);
+        return;
+    }
+
+    if (Buffer->ResourceIds != NULL)
+    {
+        KIRQL oldIrql;
+        EpochEnter(&oldIrql);
+        PVIRGL_CONTEXT virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
+        if (virglContext)
+        {
+            UpdateResourceState(virglContext, Buffer->ResourceIds, Buffer->ResourceIdsCount, FALSE);
+        }
+        EpochExit(oldIrql);
+        ExFreePoolWithTag(Buffer->ResourceIds, VIRTIO_VGPU_MEMORY_TAG);
+    }
+
+    if (Buffer->FenceObject != NULL)
+    {
+        KeSetEvent(Buffer->FenceObject, IO_NO_INCREMENT, FALSE);
+        ObDereferenceObject(Buffer->FenceObject);
+    }
+
+    // only set if the submission was dropped before reaching the host
+    if (Buffer->InFenceObject != NULL)
+    {
+        ReleaseInFence(Buffer);
+    }
+
+    FreeVgpuMemory(Buffer->pDataBuf, Buffer->DataBufSize);
+    FreeCommandBuffer(Context, Buffer);
+}
+
+VOID FlushSubmitList(PVIRGL_CONTEXT VirglContext)
+{
+    KIRQL           savedIrql;
+    BOOLEAN         bWakeFenceWaiter;
+    PLIST_ENTRY     item;
+    PDEVICE_CONTEXT context = VirglContext->DeviceContext;
+
+    SpinLock(&savedIrql, &context->SubmitSpinLock);
+    if (VirglContext->bRunnable)
+    {
+        RemoveEntryListUnsafe(&VirglContext->RunEntry);
+        VirglContext->bRunnable = FALSE;
+        context->RunCount--;
+    }
+
+    // the fence waiter still waits for the head submission, let it drop the fence
+    bWakeFenceWaiter = VirglContext->bFenceWaiting;
+    VirglContext->bFenceWaiting = FALSE;
+
+    // drop all submissions which never reached the host, waiters of their out fences would be released
+    while (!IsListEmpty(&VirglContext->SubmitList))
+    {
+        item = RemoveHeadList(&VirglContext->SubmitList);
+        RetireSubmitCommand(context, CONTAINING_RECORD(item, VGPU_BUFFER, Entry));
+    }
+    KeSetEvent(&VirglContext->SubmitIdleEvent, IO_NO_INCREMENT, FALSE);
+    SpinUnLock(savedIrql, &context->SubmitSpinLock);
+
+    if (bWakeFenceWaiter)
+    {
+        KeSetEvent(&context->FenceWaitEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+VOID WaitSubmitListIdle(PVIRGL_CONTEXT VirglContext)
+{
+    FlushCoalescedSubmit(VirglContext);
+
+    // commands pushed directly to the queue must not overtake the queued submissions
+    if (KeReadStateEvent(&VirglContext->SubmitIdleEvent) == 0)
+    {
+        KeWaitForSingleObject(&VirglContext->SubmitIdleEvent, Executive, KernelMode, FALSE, NULL);
+    }
+}
+
+VOID WaitSubmitInFlightIdle(PVIRGL_CONTEXT VirglContext)
+{
+    WaitSubmitListIdle(VirglContext);
+
+    // commands on another queue may even overtake the submissions the host is still running
+    if (KeReadStateEvent(&VirglContext->InFlightIdleEvent) == 0)
+    {
+        KeWaitForSingleObject(&VirglContext->InFlightIdleEvent, Executive, KernelMode, FALSE, NULL);
+    }
+}
+
+NTSTATUS QueueSubmitCommand(PVIRGL_CONTEXT VirglContext, PVGPU_BUFFER Buffer)
+{
+    KIRQL           savedIrql;
+    BOOLEAN         bWakeFenceWaiter;
+    PDEVICE_CONTEXT context = VirglContext->DeviceContext;
+
+    Buffer->SubmitTime = KeQueryInterruptTime();
+
+    // queue it behind the earlier submissions to keep the order of the context
+    SpinLock(&savedIrql, &context->SubmitSpinLock);
+    InsertTailList(&VirglContext->SubmitList, &Buffer->Entry);
+    KeClearEvent(&VirglContext->SubmitIdleEvent);
+
+    if (!VirglContext->bRunnable)
+    {
+        VirglContext->bRunnable = TRUE;
+        VirglContext->LastServedTime = Buffer->SubmitTime;
+        InsertTailList(&context->RunList, &VirglContext->RunEntry);
+        context->RunCount++;
+    }
+
+    bWakeFenceWaiter = ScheduleSubmitCommandsUnsafe(context);
+    SpinUnLock(savedIrql, &context->SubmitSpinLock);
+
+    if (bWakeFenceWaiter)
+    {
+        KeSetEvent(&context->FenceWaitEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+// the interrupt may be moderated, pick up the completion without it
+FORCEINLINE VOID PollQueueForWaiter(PDEVICE_CONTEXT Context, ULONG32 QueueIndex)
+{
+    if (Context->bQueuesReady && virtqueue_has_buf(Context->VirtQueues[QueueIndex]))
+    {
+        KeInsertQueueDpc(&Context->QueuePolls[QueueIndex].Dpc, NULL, NULL);
+    }
+}
+
+// spin on the event before blocking, short gpu jobs finish faster than a context switch
+BOOLEAN SpinWaitForEvent(PVIRGL_CONTEXT VirglContext, PKEVENT Event)
+{
+    ULONG64             budget, elapsed;
+    LARGE_INTEGER       startTime, frequency;
+    PDEVICE_CONTEXT     context = VirglContext->DeviceContext;
+
+    if (KeReadStateEvent(Event) != 0)
+    {
+        return TRUE;
+    }
+
+    // the jobs of this context usually take longer than any reasonable spin
+    budget = min(VirglContext->WaitSpinBudget, WAIT_SPIN_MAX_US);
+    if (GetSubmitLatencyPercentile(VirglContext, 50) > WAIT_SPIN_MAX_US)
+    {
+        return FALSE;
+    }
+
+    elapsed = 0;
+    startTime = KeQueryPerformanceCounter(&frequency);
+    do
+    {
+        if (KeReadStateEvent(Event) != 0)
+        {
+            // grow the budget while spinning pays off, concurrent waiters of the context may race on it
+            InterlockedIncrement(&VirglContext->WaitSpinHits);
+            InterlockedExchange(&VirglContext->WaitSpinBudget, (LONG)min(max(budget, elapsed * 2), WAIT_SPIN_MAX_US));
+            return TRUE;
+        }
+
+        // the awaited work may be a transfer on the transfer queue as well
+        PollQueueForWaiter(context, VirglContext->QueueIndex);
+        if (context->TransferQueueIndex != COMMAND_QUEUE && VirglContext->TransferInFlightCount > 0)
+        {
+            PollQueueForWaiter(context, context->TransferQueueIndex);
+        }
+
+        YieldProcessor();
+        elapsed = (KeQueryPerformanceCounter(NULL).QuadPart - startTime.QuadPart) * 1000000 / frequency.QuadPart;
+    } while (elapsed < budget);
+
+    // shrink it after a miss but keep probing
+    InterlockedIncrement(&VirglContext->WaitSpinMisses);
+    InterlockedExchange(&VirglContext->WaitSpinBudget, (LONG)max(budget / 2, WAIT_SPIN_MIN_US));
+    return FALSE;
+}
+
+ULONG64 GetSubmitLatencyPercentile(PVIRGL_CONTEXT VirglContext, ULONG Percent)
+{
+    ULONG64 total = 0, count = 0;
+
+    for (ULONG i = 0; i < SUBMIT_LATENCY_BUCKETS; i++)
+    {
+        total += VirglContext->LatencyHistogram[i];
+    }
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    // report the upper bound of the bucket in microseconds
+    for (ULONG i = 0; i < SUBMIT_LATENCY_BUCKETS; i++)
+    {
+        count += VirglContext->LatencyHistogram[i];
+        if (count * 100 >= total * Percent)
+        {
+            return 1ULL << (i + 1);
+        }
+    }
+
+    return 1ULL << SUBMIT_LATENCY_BUCKETS;
+}
+
+VOID FlushCoalescedSubmit(PVIRGL_CONTEXT VirglContext)
+{
+    KIRQL savedIrql;
+
+    // queue it under the lock, otherwise a later submission may overtake it
+    SpinLock(&savedIrql, &VirglContext->CoalesceSpinLock);
+    if (VirglContext->CoalesceBuffer)
+    {
+        KeCancelTimer(&VirglContext->CoalesceTimer);
+        QueueSubmitCommand(VirglContext, VirglContext->CoalesceBuffer);
+        VirglContext->CoalesceBuffer = NULL;
+    }
+    SpinUnLock(savedIrql, &VirglContext->CoalesceSpinLock);
+}
+
+VOID CoalesceTimerRoutine(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    FlushCoalescedSubmit(DeferredContext);
+}
+
+VOID InitializeCoalescer(PVIRGL_CONTEXT VirglContext)
+{
+    VirglContext->CoalesceBuffer = NULL;
+    VirglContext->UnfencedInFlightCount = 0;
+    KeInitializeSpinLock(&VirglContext->CoalesceSpinLock);
+    KeInitializeTimer(&VirglContext->CoalesceTimer);
+    KeInitializeDpc(&VirglContext->CoalesceDpc, CoalesceTimerRoutine, VirglContext);
+}
+
+VOID UninitializeCoalescer(PVIRGL_CONTEXT VirglContext)
+{
+    KIRQL savedIrql;
+
+    KeCancelTimer(&VirglContext->CoalesceTimer);
+    KeFlushQueuedDpcs();
+
+    // the host context is going away, drop the open submission
+    SpinLock(&savedIrql, &VirglContext->CoalesceSpinLock);
+    if (VirglContext->CoalesceBuffer)
+    {
+        RetireSubmitCommand(VirglContext->DeviceContext, VirglContext->CoalesceBuffer);
+        VirglContext->CoalesceBuffer = NULL;
+    }
+    SpinUnLock(savedIrql, &VirglContext->CoalesceSpinLock);
+}
+
+PVGPU_BUFFER OpenCoalesceBuffer(PVIRGL_CONTEXT VirglContext)
+{
+    MEMORY_DESCRIPTOR   command;
+    LARGE_INTEGER       dueTime;
+    PVGPU_BUFFER        buffer;
+
+    if (!AllocateVgpuMemory(COALESCE_BUFFER_SIZE, &command))
+    {
+        return NULL;
+    }
+
+    buffer = AllocateSubmitCommand(VirglContext->DeviceContext, VirglContext->Id, &command, COALESCE_BUFFER_SIZE, 0, NULL, 0, 0, NULL, NULL);
+
+    // flush it later even if no submission of this context was completed
+    dueTime.QuadPart = -10LL * COALESCE_WINDOW_US;
+    KeSetTimer(&VirglContext->CoalesceTimer, dueTime, &VirglContext->CoalesceDpc);
+
+    return buffer;
+}
+
+BOOLEAN MergeResourceIds(PVGPU_BUFFER Buffer, PULONG32 ResourceIds, SIZE_T ResourceIdsCount)
+{
+    PULONG32 ids;
+
+    if (ResourceIdsCount == 0)
+    {
+        return TRUE;
+    }
+
+    ids = ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_UNINITIALIZED, sizeof(ULONG32) * (Buffer->ResourceIdsCount + ResourceIdsCount), VIRTIO_VGPU_MEMORY_TAG);
+    if (!ids)
+    {
+        return FALSE;
+    }
+
+    if (Buffer->ResourceIds)
+    {
+        RtlCopyMemory(ids, Buffer->ResourceIds, sizeof(ULONG32) * Buffer->ResourceIdsCount);
+        ExFreePoolWithTag(Buffer->ResourceIds, VIRTIO_VGPU_MEMORY_TAG);
+    }
+    RtlCopyMemory(ids + Buffer->ResourceIdsCount, ResourceIds, sizeof(ULONG32) * ResourceIdsCount);
+
+    Buffer->ResourceIds = ids;
+    Buffer->ResourceIdsCount += ResourceIdsCount;
+    return TRUE;
+}
+
+BOOLEAN CoalesceSubmitCommand(PVIRGL_CONTEXT VirglContext, PVOID Command, SIZE_T CommandSize, PULONG32 ResourceIds, SIZE_T ResourceIdsCount)
+{
+    KIRQL                           savedIrql;
+    PVGPU_BUFFER                    buffer;
+    BOOLEAN                         bMerged = FALSE;
+    struct virtio_gpu_cmd_submit*   cmd;
+
+    if (CommandSize > COALESCE_MAX_COMMAND_SIZE)
+    {
+        return FALSE;
+    }
+
+    SpinLock(&savedIrql, &VirglContext->CoalesceSpinLock);
+
+    buffer = VirglContext->CoalesceBuffer;
+    if (buffer && ((struct virtio_gpu_cmd_submit*)buffer->pBuf)->size + CommandSize > buffer->DataBufSize)
+    {
+        // the open submission is full, send it and start a new one
+        KeCancelTimer(&VirglContext->CoalesceTimer);
+        QueueSubmitCommand(VirglContext, buffer);
+        VirglContext->CoalesceBuffer = buffer = NULL;
+    }
+
+    // don't delay anything while the host is idle for this context
+    if (!buffer && (VirglContext->UnfencedInFlightCount > 0 || !IsListEmpty(&VirglContext->SubmitList)))
+    {
+        VirglContext->CoalesceBuffer = buffer = OpenCoalesceBuffer(VirglContext);
+    }
+
+    if (buffer && MergeResourceIds(buffer, ResourceIds, ResourceIdsCount))
+    {
+        // the open submission can't be sent while we hold the lock, so the resources are idled after this
+        UpdateResourceState(VirglContext, ResourceIds, ResourceIdsCount, TRUE);
+
+        cmd = buffer->pBuf;
+        RtlCopyMemory((PUINT8)buffer->pDataBuf + cmd->size, Command, CommandSize);
+        cmd->size += (ULONG32)CommandSize;
+        bMerged = TRUE;
+    }
+
+    SpinUnLock(savedIrql, &VirglContext->CoalesceSpinLock);
+
+    return bMerged;
+}
+
+VOID CompleteSubmitCommands(PDEVICE_CONTEXT Context, PVGPU_BUFFER* Buffers, ULONG Count)
+{
+    KIRQL                       savedIrql, oldIrql;
+    ULONG64                     latency;
+    ULONG                       bucket, index, flush;
+    ULONG                       numRuns = 0, numFlushes = 0;
+    ULONG64                     now = KeQueryInterruptTime();
+    BOOLEAN                     bWork;
+    PVGPU_BUFFER                buffer;
+    PVIRGL_CONTEXT              virglContext;
+    struct virtio_gpu_ctrl_hdr* header;
+    VGPU_MEMORY_RUN             runs[COMPLETION_BATCH_SIZE];
+    PVIRGL_CONTEXT              flushContexts[COMPLETION_BATCH_SIZE];
+
+    ASSERT(Count <= COMPLETION_BATCH_SIZE);
+
+    // the contexts looked up below stay valid until the end of the batch
+    EpochEnter(&oldIrql);
+
+    // the accounting of the whole batch under one acquisition of the scheduler lock
+    SpinLock(&savedIrql, &Context->SubmitSpinLock);
+    for (index = 0; index < Count; index++)
+    {
+        header = (struct virtio_gpu_ctrl_hdr*)Buffers[index]->pBuf;
+        Context->InFlightCount--;
+
+        virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
+        if (virglContext)
+        {
+            virglContext->InFlightCount--;
+            if (virglContext->InFlightCount == 0)
+            {
+                KeSetEvent(&virglContext->InFlightIdleEvent, IO_NO_INCREMENT, FALSE);
+            }
+
+            // latency from the execbuffer to the completion, in microseconds
+            latency = (now - Buffers[index]->SubmitTime) / 10;
+            bucket = latency > 1 ? RtlFindMostSignificantBit(latency) : 0;
+            virglContext->LatencyHistogram[min(bucket, SUBMIT_LATENCY_BUCKETS - 1)]++;
+        }
+    }
+    SpinUnLock(savedIrql, &Context->SubmitSpinLock);
+
+    for (index = 0; index < Count; index++)
+    {
+        buffer = Buffers[index];
+        header = (struct virtio_gpu_ctrl_hdr*)buffer->pBuf;
+        virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
+
+        bWork = buffer->ResourceIds != NULL && buffer->ResourceIdsCount > COMPLETION_WORK_RESOURCE_IDS;
+        if (buffer->ResourceIds != NULL && !bWork)
+        {
+            if (virglContext)
+            {
+                UpdateResourceState(virglContext, buffer->ResourceIds, buffer->ResourceIdsCount, FALSE);
+            }
+            ExFreePoolWithTag(buffer->ResourceIds, VIRTIO_VGPU_MEMORY_TAG);
+        }
+
+        if (buffer->FenceObject != NULL)
+        {
+            KeSetEvent(buffer->FenceObject, IO_NO_INCREMENT, FALSE);
+            ObDereferenceObject(buffer->FenceObject);
+        }
+
+        if (buffer->InFenceObject != NULL)
+        {
+            ReleaseInFence(buffer);
+        }
+
+        // the host has caught up with this context, send what was merged meanwhile
+        if (virglContext && !IsSubmitFenced(buffer))
+        {
+            InterlockedDecrement(&virglContext->UnfencedInFlightCount);
+            for (flush = 0; flush < numFlushes && flushContexts[flush] != virglContext; flush++);
+            if (flush == numFlushes)
+            {
+                flushContexts[numFlushes++] = virglContext;
+            }
+        }
+
+        runs[numRuns].VirtualAddress = buffer->pDataBuf;
+        runs[numRuns].Size = buffer->DataBufSize;
+        numRuns++;
+
+        if (bWork)
+        {
+            QueueCompletionWork(Context, buffer);
+        }
+        else
+        {
+            FreeCommandBuffer(Context, buffer);
+        }
+    }
+
+    // the data of submissions completed together is mostly adjacent in the pool
+    FreeVgpuMemoryRuns(runs, numRuns);
+
+    for (flush = 0; flush < numFlushes; flush++)
+    {
+        FlushCoalescedSubmit(flushContexts[flush]);
+    }
+
+    EpochExit(oldIrql);
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "global.h"
+
+NTSTATUS InitializeScheduler(PDEVICE_CONTEXT Context);
+VOID UninitializeScheduler(PDEVICE_CONTEXT Context);
+VOID ScheduleSubmitCommands(PDEVICE_CONTEXT Context);
+VOID SetVirglContextPriority(PVIRGL_CONTEXT VirglContext, UINT8 Priority);
+VOID InitializeSubmitList(PVIRGL_CONTEXT VirglContext);
+VOID FlushSubmitList(PVIRGL_CONTEXT VirglContext);
+VOID WaitSubmitListIdle(PVIRGL_CONTEXT VirglContext);
+VOID WaitSubmitInFlightIdle(PVIRGL_CONTEXT VirglContext);
+BOOLEAN SpinWaitForEvent(PVIRGL_CONTEXT VirglContext, PKEVENT Event);
+VOID InitializeCoalescer(PVIRGL_CONTEXT VirglContext);
+VOID UninitializeCoalescer(PVIRGL_CONTEXT VirglContext);
+VOID FlushCoalescedSubmit(PVIRGL_CONTEXT VirglContext);
+BOOLEAN CoalesceSubmitCommand(PVIRGL_CONTEXT VirglContext, PVOID Command, SIZE_T CommandSize, PULONG32 ResourceIds, SIZE_T ResourceIdsCount);
+VOID RetireSubmitCommand(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer);
+VOID CompleteSubmitCommands(PDEVICE_CONTEXT Context, PVGPU_BUFFER* Buffers, ULONG Count);
+NTSTATUS QueueSubmitCommand(PVIRGL_CONTEXT VirglContext, PVGPU_BUFFER Buffer);
+ULONG64 GetSubmitLatencyPercentile(PVIRGL_CONTEXT VirglContext, ULONG Percent);
\ No newline at end of file
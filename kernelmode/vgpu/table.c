@@ -0,0 +1,149 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "control.h"
+#include "table.h"
+
+
+// the resource is returned with a reference, the caller must drop it with PutResource
+PVIRGL_RESOURCE GetResourceFromList(PVIRGL_CONTEXT VirglContext, ULONG32 Id)
+{
+    KIRQL           oldIrql;
+    BOOLEAN         bClosed = FALSE;
+    PVIRGL_RESOURCE resource;
+
+    EpochEnter(&oldIrql);
+    resource = GetResourceFromListUnsafe(VirglContext, Id);
+    if (resource && !EpochTryReference(&resource->RefCount))
+    {
+        resource = NULL;
+    }
+
+    // a closed resource only stays in the table to follow its last fence,
+    // the reference was taken before the check so the close sees it otherwise
+    if (resource && resource->bClosed)
+    {
+        bClosed = TRUE;
+    }
+    EpochExit(oldIrql);
+
+    // ours may be the last reference, drop it at the level of the caller
+    if (bClosed)
+    {
+        PutResource(VirglContext, resource);
+        resource = NULL;
+    }
+
+    return resource;
+}
+
+VOID FreeResourceTableCallback(PEPOCH_ENTRY Entry, PVOID FreeContext)
+{
+    UNREFERENCED_PARAMETER(FreeContext);
+
+    ExFreePoolWithTag(CONTAINING_RECORD(Entry, VIRGL_RESOURCE_TABLE, RetireEntry), VIRTIO_VGPU_MEMORY_TAG);
+}
+
+PVIRGL_RESOURCE_TABLE AllocateResourceTable(ULONG32 Size)
+{
+    PVIRGL_RESOURCE_TABLE table;
+
+    table = ExAllocatePool2(POOL_FLAG_NON_PAGED, FIELD_OFFSET(VIRGL_RESOURCE_TABLE, Slots) + Size * sizeof(PVIRGL_RESOURCE), VIRTIO_VGPU_MEMORY_TAG);
+    if (table)
+    {
+        table->Size = Size;
+        table->UsedCount = 0;
+    }
+
+    return table;
+}
+
+// copy the live resources into a new table, which also drops the tombstones
+BOOLEAN RebuildResourceTableUnsafe(PVIRGL_CONTEXT VirglContext)
+{
+    ULONG32                 index, slot, size;
+    PVIRGL_RESOURCE         resource;
+    PVIRGL_RESOURCE_TABLE   oldTable = VirglContext->ResourceTable;
+    PVIRGL_RESOURCE_TABLE   newTable;
+
+    // grow once the live resources take a quarter, otherwise only the tombstones are dropped
+    size = (VirglContext->ResourceTableCount + 1) * 4 > oldTable->Size ? oldTable->Size * 2 : oldTable->Size;
+    newTable = AllocateResourceTable(size);
+    if (!newTable)
+    {
+        VGPU_DEBUG_LOG("allocate resource table failed size=%u", size);
+        return FALSE;
+    }
+
+    for (index = 0; index < oldTable->Size; index++)
+    {
+        resource = oldTable->Slots[index];
+        if (resource && resource != RESOURCE_TABLE_TOMBSTONE)
+        {
+            for (slot = GetResourceTableSlot(resource->Id, newTable->Size); newTable->Slots[slot]; slot = (slot + 1) & (newTable->Size - 1));
+            newTable->Slots[slot] = resource;
+            newTable->UsedCount++;
+        }
+    }
+
+    // readers still probing the old table finish there before it is freed
+    InterlockedExchangePointer((PVOID volatile*)&VirglContext->ResourceTable, newTable);
+    EpochRetire(&oldTable->RetireEntry, FreeResourceTableCallback, NULL);
+
+    return TRUE;
+}
+
+BOOLEAN InsertResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+{
+    KIRQL                   savedIrql;
+    ULONG32                 slot;
+    PVIRGL_RESOURCE_TABLE   table;
+
+    SpinLock(&savedIrql, &VirglContext->ResourceListSpinLock);
+
+    // keep the live and dead slots under one half so the probes stay short
+    if ((VirglContext->ResourceTable->UsedCount + 1) * 2 > VirglContext->ResourceTable->Size && !RebuildResourceTableUnsafe(VirglContext))
+    {
+        SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+        return FALSE;
+    }
+
+    table = VirglContext->ResourceTable;
+    for (slot = GetResourceTableSlot(Resource->Id, table->Size); table->Slots[slot]; slot = (slot + 1) & (table->Size - 1));
+    InterlockedExchangePointer((PVOID volatile*)&table->Slots[slot], Resource);
+    table->UsedCount++;
+    VirglContext->ResourceTableCount++;
+    InsertHeadList(&VirglContext->ResourceList, &Resource->Entry);
+
+    SpinUnLock(savedIrql, &VirglContext->ResourceListSpinLock);
+    return TRUE;
+}
+
+VOID RemoveResourceUnsafe(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource)
+{
+    ULONG32                 slot;
+    PVIRGL_RESOURCE_TABLE   table = VirglContext->ResourceTable;
+
+    for (slot = GetResourceTableSlot(Resource->Id, table->Size); table->Slots[slot] != Resource; slot = (slot + 1) & (table->Size - 1));
+
+    // the slot stays used until the next rebuild
+    InterlockedExchangePointer((PVOID volatile*)&table->Slots[slot], RESOURCE_TABLE_TOMBSTONE);
+    VirglContext->ResourceTableCount--;
+    RemoveEntryListUnsafe(&Resource->Entry);
+}
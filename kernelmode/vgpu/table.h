@@ -0,0 +1,56 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "global.h"
+#include "epoch.h"
+
+FORCEINLINE ULONG32 GetResourceTableSlot(ULONG32 Id, ULONG32 TableSize)
+{
+    // fibonacci hashing spreads the sequential ids from the idr over the table
+    return (Id * 0x9E3779B1) & (TableSize - 1);
+}
+
+// must be called inside an epoch read section or under the resource lock
+FORCEINLINE PVIRGL_RESOURCE GetResourceFromListUnsafe(PVIRGL_CONTEXT VirglContext, ULONG32 Id)
+{
+    ULONG32                 slot;
+    PVIRGL_RESOURCE         resource;
+    PVIRGL_RESOURCE_TABLE   table = VirglContext->ResourceTable;
+
+    // the table is never full, so the probe always reaches an empty slot
+    for (slot = GetResourceTableSlot(Id, table->Size); ; slot = (slot + 1) & (table->Size - 1))
+    {
+        resource = table->Slots[slot];
+        if (!resource)
+        {
+            return NULL;
+        }
+
+        if (resource != RESOURCE_TABLE_TOMBSTONE && resource->Id == Id)
+        {
+            return resource;
+        }
+    }
+}
+
+PVIRGL_RESOURCE_TABLE AllocateResourceTable(ULONG32 Size);
+VOID FreeResourceTableCallback(PEPOCH_ENTRY Entry, PVOID FreeContext);
+PVIRGL_RESOURCE GetResourceFromList(PVIRGL_CONTEXT VirglContext, ULONG32 Id);
+BOOLEAN InsertResource(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource);
+VOID RemoveResourceUnsafe(PVIRGL_CONTEXT VirglContext, PVIRGL_RESOURCE Resource);
@@ -23,6 +23,9 @@
 #include "command.h"
 #include "memory.h"
 #include "idr.h"
+#include "submit.h"
+#include "worker.h"
+#include "epoch.h"
 
 // gloval variables
 CAPSETS Capsets;
@@ -33,111 +36,437 @@ KSPIN_LOCK VirglContextListSpinLock;
 #pragma code_seg()
 
 
-VOID ProcessNotify(IN HANDLE ParentId, IN HANDLE ProcessId, IN BOOLEAN Create)
+VOID VirtioVgpuFileCleanup(IN WDFFILEOBJECT FileObject)
 {
-    UNREFERENCED_PARAMETER(ParentId);
+    PFILE_CONTEXT   fileContext = GetFileContext(FileObject);
+    PVIRGL_CONTEXT  virglContext = InterlockedExchangePointer((PVOID volatile*)&fileContext->VirglContext, NULL);
 
-    PVIRGL_CONTEXT  virglContext;
-
-    if (!Create)
+    // the last handle was closed without destroying its virgl context, e.g. the process exited
+    if (virglContext)
     {
-        virglContext = GetVirglContextFromList(HandleToULong(ProcessId));
-        if (virglContext)
-        {
-            CtlDestroyVirglContext(virglContext);
-            VGPU_DEBUG_LOG("delete virgl context in process notify context_id=%d", virglContext->Id);
-        }
+        VGPU_DEBUG_LOG("delete virgl context in file cleanup context_id=%d", virglContext->Id);
+        PutVirglContext(virglContext);
     }
 }
 
-VOID VirtioVgpuReadFromQueue(PDEVICE_CONTEXT Context, struct virtqueue* pVirtQueue, WDFSPINLOCK vqLock)
+// read up to Budget completions, the callbacks of the queue must be disabled
+UINT32 VirtioVgpuReadFromQueue(PDEVICE_CONTEXT Context, struct virtqueue* pVirtQueue, WDFSPINLOCK vqLock, UINT32 Budget)
 {
-    UINT32                      length;
+    UINT32                      length, count, index, total = 0;
+    ULONG                       numCompleted;
     PVGPU_BUFFER                buffer;
+    PVGPU_BUFFER                buffers[COMPLETION_BATCH_SIZE];
+    PVGPU_BUFFER                completed[COMPLETION_BATCH_SIZE];
     struct virtio_gpu_ctrl_hdr* header;
+    LARGE_INTEGER               startTime, endTime, frequency;
 
-    while (TRUE)
+    startTime = KeQueryPerformanceCounter(&frequency);
+
+    while (total < Budget)
     {
+        // pop a run of completions with one lock acquisition
+        count = 0;
         WdfSpinLockAcquire(vqLock);
-        buffer = virtqueue_get_buf(pVirtQueue, &length);
+        while (count < COMPLETION_BATCH_SIZE && total + count < Budget && (buffers[count] = virtqueue_get_buf(pVirtQueue, &length)) != NULL)
+        {
+            count++;
+        }
         WdfSpinLockRelease(vqLock);
 
-        if (!buffer)
+        if (count == 0)
         {
             break;
         }
 
-        header = (struct virtio_gpu_ctrl_hdr*)buffer->pBuf;
-        switch (header->type)
-        {
-        case VIRTIO_GPU_CMD_GET_CAPSET:
-        case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
-            KeSetEvent(&buffer->Event, IO_NO_INCREMENT, FALSE);
-            break;
-        case VIRTIO_GPU_CMD_SUBMIT_3D:
+        total += count;
+        numCompleted = 0;
+        for (index = 0; index < count; index++)
         {
-            if (buffer->ResourceIds != NULL)
+            buffer = buffers[index];
+            header = (struct virtio_gpu_ctrl_hdr*)buffer->pBuf;
+            switch (header->type)
+            {
+            case VIRTIO_GPU_CMD_GET_CAPSET:
+            case VIRTIO_GPU_CMD_GET_CAPSET_INFO:
+                KeSetEvent(&buffer->Event, IO_NO_INCREMENT, FALSE);
+                break;
+            case VIRTIO_GPU_CMD_SUBMIT_3D:
+                completed[numCompleted++] = buffer;
+                break;
+            case VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB:
+                // mapping the io space is too slow for the dpc
+                QueueCompletionWork(Context, buffer);
+                break;
+            case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
+            case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
             {
+                KIRQL oldIrql;
+                EpochEnter(&oldIrql);
                 PVIRGL_CONTEXT virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
                 if (virglContext)
                 {
-                    UpdateResourceState(virglContext, buffer->ResourceIds, buffer->ResourceIdsCount, FALSE, header->fence_id);
+                    struct virtio_gpu_transfer_host_3d* transfer = (struct virtio_gpu_transfer_host_3d*)buffer->pBuf;
+                    UpdateResourceState(virglContext, &((ULONG32)transfer->resource_id), 1, FALSE);
+
+                    // the submissions held back by this transfer are scheduled below
+                    if (Context->TransferQueueIndex != COMMAND_QUEUE)
+                    {
+                        InterlockedDecrement(&virglContext->TransferInFlightCount);
+                    }
                 }
-                ExFreePoolWithTag(buffer->ResourceIds, VIRTIO_VGPU_MEMORY_TAG);
+                EpochExit(oldIrql);
             }
-
-            if (buffer->FenceObject != NULL)
-            {
-                KeSetEvent(buffer->FenceObject, IO_NO_INCREMENT, FALSE);
+            case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
+            case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
+            case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D_WITH_BACKING:
+            case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
+            case VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB:
+            case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
+            case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
+            case VIRTIO_GPU_CMD_CTX_CREATE:
+            case VIRTIO_GPU_CMD_CTX_DESTROY:
+            case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
+            case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
+            case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+                FreeCommandBuffer(Context, buffer);
+                break;
+            case VIRTIO_GPU_CMD_RESOURCE_UNREF:
+                // the host has dropped the resource, its id can be handed out again
+                PutResourceIdToIdr(((struct virtio_gpu_resource_unref*)buffer->pBuf)->resource_id);
+                FreeCommandBuffer(Context, buffer);
+                break;
+            default:
+                VGPU_DEBUG_LOG("unknown cmd type=%d", header->type);
+                FreeCommandBuffer(Context, buffer);
+                break;
             }
+        }
 
-            FreeVgpuMemory(buffer->pDataBuf, buffer->DataBufSize);
-            FreeCommandBuffer(Context, buffer);
+        // retire the submissions of the run together
+        if (numCompleted > 0)
+        {
+            CompleteSubmitCommands(Context, completed, numCompleted);
+        }
+    }
+
+    endTime = KeQueryPerformanceCounter(NULL);
+    InterlockedAdd64(&Context->CompletionCount, total);
+    InterlockedAdd64(&Context->CompletionTime, (endTime.QuadPart - startTime.QuadPart) * 1000000 / frequency.QuadPart);
+
+    // completions above free host slots and signal the fences of queued submissions
+    if (Context->RunCount > 0)
+    {
+        ScheduleSubmitCommands(Context);
+    }
+
+    return total;
+}
+
+// busy queues interrupt once per batch of completions, quiet ones on every completion
+VOID VirtioVgpuModerateInterrupt(PDEVICE_CONTEXT Context, PVGPU_QUEUE_POLL Poll, UINT32 Count)
+{
+    ULONG64 now = KeQueryInterruptTime();
+    BOOLEAN bModerated;
+
+    Poll->RateCount += Count;
+    if (now - Poll->RateWindowStart < MODERATION_WINDOW_MS * 10000ULL)
+    {
+        return;
+    }
+
+    bModerated = Poll->RateCount >= MODERATION_THRESHOLD;
+    if (bModerated != Poll->bModerated)
+    {
+        Poll->bModerated = bModerated;
+        InterlockedIncrement64(&Context->QueueModeSwitchCount[Poll->QueueIndex]);
+    }
+    Poll->RateCount = 0;
+    Poll->RateWindowStart = now;
+}
+
+// caller must own the bServicing flag of the queue, returns the number of completions read
+UINT32 VirtioVgpuServiceQueueUnsafe(PDEVICE_CONTEXT Context, ULONG32 QueueIndex)
+{
+    UINT32              count;
+    BOOLEAN             bEmpty;
+    LONG64              duration, maxTime;
+    LARGE_INTEGER       startTime, endTime, frequency;
+    PVGPU_QUEUE_POLL    poll = &Context->QueuePolls[QueueIndex];
+    struct virtqueue*   pVirtQueue = Context->VirtQueues[QueueIndex];
+    WDFSPINLOCK         vqLock = Context->VirtQueueLocks[QueueIndex];
+
+    // a poll queued while the device left D0 finds the queues destroyed
+    if (!Context->bQueuesReady)
+    {
+        return 0;
+    }
+
+    startTime = KeQueryPerformanceCounter(&frequency);
+
+    WdfSpinLockAcquire(vqLock);
+    virtqueue_disable_cb(pVirtQueue);
+    WdfSpinLockRelease(vqLock);
+
+    count = VirtioVgpuReadFromQueue(Context, pVirtQueue, vqLock, COMPLETION_BUDGET);
+    DrainQueue(Context, QueueIndex);
+    VirtioVgpuModerateInterrupt(Context, poll, count);
+
+    if (Context->bPollThreadActive)
+    {
+        // the polling thread owns the queue, leave its interrupt off
+    }
+    else if (count >= COMPLETION_BUDGET)
+    {
+        // over budget, keep the interrupt off and poll again from a fresh dpc
+        if (!poll->bPolling)
+        {
+            poll->bPolling = TRUE;
+            InterlockedIncrement64(&Context->QueueModeSwitchCount[QueueIndex]);
+        }
+        KeInsertQueueDpc(&poll->Dpc, NULL, NULL);
+    }
+    else
+    {
+        if (poll->bPolling)
+        {
+            poll->bPolling = FALSE;
+            InterlockedIncrement64(&Context->QueueModeSwitchCount[QueueIndex]);
+        }
+
+        WdfSpinLockAcquire(vqLock);
+        bEmpty = poll->bModerated ? virtqueue_enable_cb_delayed(pVirtQueue) : virtqueue_enable_cb(pVirtQueue);
+        if (!bEmpty)
+        {
+            virtqueue_disable_cb(pVirtQueue);
+        }
+        WdfSpinLockRelease(vqLock);
+
+        // completions arrived while the interrupt was re-armed
+        if (!bEmpty)
+        {
+            KeInsertQueueDpc(&poll->Dpc, NULL, NULL);
+        }
+    }
+
+    endTime = KeQueryPerformanceCounter(NULL);
+    duration = (endTime.QuadPart - startTime.QuadPart) * 1000000 / frequency.QuadPart;
+    InterlockedIncrement64(&Context->QueueDpcCount[QueueIndex]);
+    InterlockedAdd64(&Context->QueueDpcTime[QueueIndex], duration);
+    do
+    {
+        maxTime = Context->QueueDpcMaxTime[QueueIndex];
+        if (duration <= maxTime)
+        {
             break;
         }
-        case VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB:
+    } while (InterlockedCompareExchange64(&Context->QueueDpcMaxTime[QueueIndex], duration, maxTime) != maxTime);
+
+    return count;
+}
+
+// the interrupt dpc, the poll dpc and the polling thread may all come here for the same queue,
+// only one of them reads it at a time and the others leave a request for another pass
+UINT32 VirtioVgpuServiceQueue(PDEVICE_CONTEXT Context, ULONG32 QueueIndex)
+{
+    UINT32              count = 0;
+    PVGPU_QUEUE_POLL    poll = &Context->QueuePolls[QueueIndex];
+
+    InterlockedExchange(&poll->bServiceRequested, TRUE);
+    while (InterlockedCompareExchange(&poll->bServicing, TRUE, FALSE) == FALSE)
+    {
+        if (InterlockedExchange(&poll->bServiceRequested, FALSE))
+        {
+            count += VirtioVgpuServiceQueueUnsafe(Context, QueueIndex);
+        }
+
+        InterlockedExchange(&poll->bServicing, FALSE);
+
+        // check again for a request left by a caller which lost the race above
+        if (!poll->bServiceRequested)
         {
-            PVIRGL_CONTEXT virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
-            if (virglContext)
-            {
-                struct virtio_gpu_resource_map_blob* cmd = (struct virtio_gpu_resource_map_blob*)buffer->pBuf;
-                struct virtio_gpu_resp_map_info* resp = (struct virtio_gpu_resp_map_info*)buffer->pRespBuf;
-                //FIXME: how to use map_info ?
-                MapBlobResourceCallback(virglContext, cmd->resource_id, resp->gpa, resp->size);
-            }
-            FreeCommandBuffer(Context, buffer);
             break;
         }
-        case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_3D:
-        case VIRTIO_GPU_CMD_TRANSFER_FROM_HOST_3D:
+    }
+
+    return count;
+}
+
+// switch all queues between the polling thread and their interrupts
+VOID VirtioVgpuSetPollThreadActive(PDEVICE_CONTEXT Context, BOOLEAN Active)
+{
+    BOOLEAN bEmpty;
+
+    Context->bPollThreadActive = Active;
+
+    for (ULONG32 i = 0; i < Context->NumVirtQueues; i++)
+    {
+        WdfSpinLockAcquire(Context->VirtQueueLocks[i]);
+        if (Active)
+        {
+            virtqueue_disable_cb(Context->VirtQueues[i]);
+            bEmpty = TRUE;
+        }
+        else
+        {
+            bEmpty = virtqueue_enable_cb(Context->VirtQueues[i]);
+        }
+        WdfSpinLockRelease(Context->VirtQueueLocks[i]);
+
+        // the dpc re-arms the queue after reading what arrived meanwhile
+        if (!bEmpty)
+        {
+            KeInsertQueueDpc(&Context->QueuePolls[i].Dpc, NULL, NULL);
+        }
+    }
+}
+
+VOID VirtioVgpuPollThreadRoutine(PVOID StartContext)
+{
+    KIRQL               oldIrql;
+    UINT32              count;
+    LONG64              duration;
+    ULONG64             lastBusyTime = 0;
+    LARGE_INTEGER       startTime, endTime, frequency;
+    PROCESSOR_NUMBER    processor;
+    GROUP_AFFINITY      affinity, oldAffinity;
+    PDEVICE_CONTEXT     context = StartContext;
+
+    // the polling thread takes the chosen processor for itself
+    KeGetProcessorNumberFromIndex(context->PollThreadProcessor, &processor);
+    RtlZeroMemory(&affinity, sizeof(affinity));
+    affinity.Group = processor.Group;
+    affinity.Mask = (KAFFINITY)1 << processor.Number;
+    KeSetSystemGroupAffinityThread(&affinity, &oldAffinity);
+
+    while (!context->bPollThreadStop)
+    {
+        if (!context->bPollThreadActive)
         {
-            PVIRGL_CONTEXT virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
-            if (virglContext)
+            // sleep in interrupt mode until the next submission
+            KeWaitForSingleObject(&context->PollThreadEvent, Executive, KernelMode, FALSE, NULL);
+            if (context->bPollThreadStop)
             {
-                struct virtio_gpu_transfer_host_3d* transfer = (struct virtio_gpu_transfer_host_3d*)buffer->pBuf;
-                UpdateResourceState(virglContext, &((ULONG32)transfer->resource_id), 1, FALSE, header->fence_id);
+                break;
             }
+
+            VirtioVgpuSetPollThreadActive(context, TRUE);
+            lastBusyTime = KeQueryInterruptTime();
         }
-        case VIRTIO_GPU_CMD_RESOURCE_CREATE_2D:
-        case VIRTIO_GPU_CMD_RESOURCE_CREATE_3D:
-        case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
-        case VIRTIO_GPU_CMD_RESOURCE_UNMAP_BLOB:
-        case VIRTIO_GPU_CMD_RESOURCE_UNREF:
-        case VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING:
-        case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
-        case VIRTIO_GPU_CMD_CTX_CREATE:
-        case VIRTIO_GPU_CMD_CTX_DESTROY:
-        case VIRTIO_GPU_CMD_CTX_ATTACH_RESOURCE:
-        case VIRTIO_GPU_CMD_CTX_DETACH_RESOURCE:
-        case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
-            FreeCommandBuffer(Context, buffer);
-            break;
-        default:
-            VGPU_DEBUG_LOG("unknown cmd type=%d", header->type);
-            FreeCommandBuffer(Context, buffer);
-            break;
+
+        startTime = KeQueryPerformanceCounter(&frequency);
+
+        // the completion path expects to run at dispatch level like the dpc, a dpc still
+        // servicing a queue keeps it and reads what the thread asked for
+        count = 0;
+        KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+        for (ULONG32 i = 0; i < context->NumVirtQueues; i++)
+        {
+            count += VirtioVgpuServiceQueue(context, i);
+        }
+        KeLowerIrql(oldIrql);
+
+        if (count > 0)
+        {
+            lastBusyTime = KeQueryInterruptTime();
+        }
+        else if (KeQueryInterruptTime() - lastBusyTime > POLL_THREAD_IDLE_MS * 10000ULL)
+        {
+            VirtioVgpuSetPollThreadActive(context, FALSE);
+        }
+        else
+        {
+            YieldProcessor();
         }
+
+        endTime = KeQueryPerformanceCounter(NULL);
+        duration = (endTime.QuadPart - startTime.QuadPart) * 1000000 / frequency.QuadPart;
+        InterlockedAdd64(&context->PollThreadTime, duration);
+        if (count > 0)
+        {
+            InterlockedAdd64(&context->PollThreadBusyTime, duration);
+        }
+    }
+
+    if (context->bPollThreadActive)
+    {
+        VirtioVgpuSetPollThreadActive(context, FALSE);
+    }
+
+    KeRevertToUserGroupAffinityThread(&oldAffinity);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// the polling thread is enabled by the PollingProcessor value of the device key
+NTSTATUS VirtioVgpuStartPollThread(IN WDFDEVICE Device)
+{
+    NTSTATUS        status;
+    WDFKEY          key;
+    HANDLE          threadHandle;
+    PDEVICE_CONTEXT context = GetDeviceContext(Device);
+    DECLARE_CONST_UNICODE_STRING(valueName, L"PollingProcessor");
+
+    context->PollThread = NULL;
+    context->bPollThreadStop = FALSE;
+    context->bPollThreadActive = FALSE;
+    KeInitializeEvent(&context->PollThreadEvent, SynchronizationEvent, FALSE);
+
+    status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (!NT_SUCCESS(status))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    status = WdfRegistryQueryULong(key, (PUNICODE_STRING)&valueName, &context->PollThreadProcessor);
+    WdfRegistryClose(key);
+    if (!NT_SUCCESS(status) || context->PollThreadProcessor >= KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, VirtioVgpuPollThreadRoutine, context);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("PsCreateSystemThread failed status=0x%08x", status);
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, NULL, KernelMode, &context->PollThread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("ObReferenceObjectByHandle failed status=0x%08x", status);
+        return status;
     }
+
+    VGPU_DEBUG_LOG("polling thread started processor=%d", context->PollThreadProcessor);
+    return STATUS_SUCCESS;
+}
+
+VOID VirtioVgpuStopPollThread(PDEVICE_CONTEXT Context)
+{
+    if (!Context->PollThread)
+    {
+        return;
+    }
+
+    Context->bPollThreadStop = TRUE;
+    KeSetEvent(&Context->PollThreadEvent, IO_NO_INCREMENT, FALSE);
+
+    KeWaitForSingleObject(Context->PollThread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Context->PollThread);
+    Context->PollThread = NULL;
+}
+
+VOID VirtioVgpuPollDpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PVGPU_QUEUE_POLL poll = DeferredContext;
+
+    VirtioVgpuServiceQueue(poll->Context, poll->QueueIndex);
 }
 
 VOID VirtioVgpuInterruptDpc(IN WDFINTERRUPT Interrupt, IN WDFOBJECT AssociatedObject)
@@ -146,8 +475,6 @@ VOID VirtioVgpuInterruptDpc(IN WDFINTERRUPT Interrupt, IN WDFOBJECT AssociatedOb
 
     WDF_INTERRUPT_INFO  info;
     PDEVICE_CONTEXT     context;
-    WDFSPINLOCK         vqLock = NULL;
-    struct virtqueue*   pVirtqueue = NULL;
 
     WDF_INTERRUPT_INFO_INIT(&info);
     WdfInterruptGetInfo(Interrupt, &info);
@@ -155,21 +482,13 @@ VOID VirtioVgpuInterruptDpc(IN WDFINTERRUPT Interrupt, IN WDFOBJECT AssociatedOb
 
     if (info.MessageSignaled && info.MessageNumber < context->NumVirtQueues)
     {
-        pVirtqueue = context->VirtQueues[info.MessageNumber];
-        vqLock = context->VirtQueueLocks[info.MessageNumber];
-    }
-
-    if (pVirtqueue != NULL)
-    {
-        VirtioVgpuReadFromQueue(context, pVirtqueue, vqLock);
+        VirtioVgpuServiceQueue(context, info.MessageNumber);
     }
     else
     {
-        for (size_t i = 0; i < context->NumVirtQueues; i++)
+        for (ULONG32 i = 0; i < context->NumVirtQueues; i++)
         {
-            pVirtqueue = context->VirtQueues[i];
-            vqLock = context->VirtQueueLocks[i];
-            VirtioVgpuReadFromQueue(context, pVirtqueue, vqLock);
+            VirtioVgpuServiceQueue(context, i);
         }
     }
 }
@@ -189,6 +508,11 @@ BOOLEAN VirtioVgpuInterruptIsr(IN WDFINTERRUPT Interrupt, IN ULONG MessageId)
     if (info.MessageSignaled || VirtIOWdfGetISRStatus(&context->VDevice))
     {
         WdfInterruptQueueDpcForIsr(Interrupt);
+        InterlockedIncrement64(&context->InterruptCount);
+        if (info.MessageSignaled && info.MessageNumber < MAX_INTERRUPT_COUNT)
+        {
+            InterlockedIncrement64(&context->QueueInterruptCount[info.MessageNumber]);
+        }
         serviced = TRUE;
     }
     else
@@ -267,6 +591,10 @@ VOID VirtioVgpuIoControl(IN WDFQUEUE Queue, IN WDFREQUEST Request, IN size_t Out
 {
     NTSTATUS        status = STATUS_UNSUCCESSFUL;
     SIZE_T          bytesReturn = 0;
+    PVIRGL_CONTEXT  virglContext;
+
+    // the reference keeps the context alive while the ioctl runs, even against a concurrent destroy
+    virglContext = GetVirglContextFromRequest(Request);
 
     switch (IoControlCode)
     {
@@ -275,42 +603,51 @@ VOID VirtioVgpuIoControl(IN WDFQUEUE Queue, IN WDFREQUEST Request, IN size_t Out
         break;
     case IOCTL_VIRTIO_VGPU_DESTROY_CONTEXT: 
     {
-        PVIRGL_CONTEXT virglContext = GetVirglContextFromList(HandleToULong(PsGetCurrentProcessId()));
-        if (virglContext)
+        // only one destroy takes the context away from the handle, the last ioctl using it frees it
+        PFILE_CONTEXT fileContext = GetFileContext(WdfRequestGetFileObject(Request));
+        PVIRGL_CONTEXT destroyContext = InterlockedExchangePointer((PVOID volatile*)&fileContext->VirglContext, NULL);
+        if (destroyContext)
         {
-            status = CtlDestroyVirglContext(virglContext);
+            PutVirglContext(destroyContext);
+            status = STATUS_SUCCESS;
         }
         break;
     }
     case IOCTL_VIRTIO_VGPU_GETPARAM:
-        status = CtlGetParams(GetDeviceContext(WdfIoQueueGetDevice(Queue)), Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        status = CtlGetParams(GetDeviceContext(WdfIoQueueGetDevice(Queue)), virglContext, Request, OutputBufferLength, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_GET_CAPS:
         status = CtlGetCaps(GetDeviceContext(WdfIoQueueGetDevice(Queue)), Request, OutputBufferLength, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_RESOURCE_CREATE:
-        status = CtlCreateResource(Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        status = CtlCreateResource(virglContext, Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        break;
+    case IOCTL_VIRTIO_VGPU_RESOURCE_CREATE_BATCH:
+        status = CtlCreateResources(virglContext, Request, OutputBufferLength, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_RESOURCE_CLOSE:
-        status = CtlCloseResource(Request, InputBufferLength, &bytesReturn);
+        status = CtlCloseResource(virglContext, Request, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_WAIT:
-        status = CtlWait(Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        status = CtlWait(virglContext, Request, OutputBufferLength, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_MAP:
-        status = CtlMap(Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        status = CtlMap(virglContext, Request, OutputBufferLength, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_EXECBUFFER:
-        status = CtlSubmitCommand(Request, InputBufferLength, &bytesReturn);
+        status = CtlSubmitCommand(virglContext, Request, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_TRANSFER_FROM_HOST:
-        status = CtlTransferHost(FALSE, Request, InputBufferLength, &bytesReturn);
+        status = CtlTransferHost(virglContext, FALSE, Request, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_TRANSFER_TO_HOST:
-        status = CtlTransferHost(TRUE, Request, InputBufferLength, &bytesReturn);
+        status = CtlTransferHost(virglContext, TRUE, Request, InputBufferLength, &bytesReturn);
         break;
     case IOCTL_VIRTIO_VGPU_BLOB_RESOURCE_CREATE:
-        status = CtlCreateBlobResource(Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        status = CtlCreateBlobResource(virglContext, Request, OutputBufferLength, InputBufferLength, &bytesReturn);
+        break;
+    case IOCTL_VIRTIO_VGPU_CONTEXT_SET_PARAM:
+        status = CtlSetVirglContextParam(virglContext, Request, InputBufferLength, &bytesReturn);
         break;
     default:
         status = STATUS_NOT_SUPPORTED;
@@ -318,6 +655,11 @@ VOID VirtioVgpuIoControl(IN WDFQUEUE Queue, IN WDFREQUEST Request, IN size_t Out
         break;
     }
 
+    if (virglContext)
+    {
+        PutVirglContext(virglContext);
+    }
+
     if (!NT_SUCCESS(status))
     {
         VGPU_DEBUG_LOG("io control failed status=0x%08x code=%d", status, IoControlCode);
@@ -354,6 +696,8 @@ NTSTATUS VirtioVgpuDevicePrepareHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
     WDF_OBJECT_ATTRIBUTES       attributes;
     PHYSICAL_ADDRESS            highestAcceptableAddress;
     SIZE_T                      vgpuMemorySize;
+    ULONGLONG                   deviceFeatures;
+    ULONGLONG                   driverFeatures = 0;
 
     PAGED_CODE();
 
@@ -368,6 +712,27 @@ NTSTATUS VirtioVgpuDevicePrepareHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
         return status;
     }
 
+    // use packed rings if the device offers them, a command then touches one ring instead of three
+    deviceFeatures = VirtIOWdfGetDeviceFeatures(&context->VDevice);
+    if (virtio_is_feature_enabled(deviceFeatures, VIRTIO_F_RING_PACKED))
+    {
+        virtio_feature_enable(driverFeatures, VIRTIO_F_RING_PACKED);
+    }
+
+    // let both sides suppress notifications the other one does not wait for
+    if (virtio_is_feature_enabled(deviceFeatures, VIRTIO_RING_F_EVENT_IDX))
+    {
+        virtio_feature_enable(driverFeatures, VIRTIO_RING_F_EVENT_IDX);
+    }
+
+    status = VirtIOWdfSetDriverFeatures(&context->VDevice, driverFeatures, 0);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("VirtIOWdfSetDriverFeatures failed status=0x%08x", status);
+        return status;
+    }
+    VGPU_DEBUG_LOG("device features=0x%llx driver features=0x%llx", deviceFeatures, driverFeatures);
+
     // get virtio config NumVirtQueues
     VirtIOWdfDeviceGet(&context->VDevice, FIELD_OFFSET(struct virtio_vgpu_config, num_queues), &context->NumVirtQueues, sizeof(UINT8));
     ASSERT(context->NumVirtQueues > 0 && context->NumVirtQueues <= MAX_INTERRUPT_COUNT);
@@ -381,9 +746,30 @@ NTSTATUS VirtioVgpuDevicePrepareHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
     context->VirtQueueLocks = ExAllocatePool2(POOL_FLAG_NON_PAGED, context->NumVirtQueues * sizeof(WDFSPINLOCK), VIRTIO_VGPU_MEMORY_TAG);
     ASSERT(context->VirtQueueLocks != NULL);
 
+    // create submission staging list for each queue
+    context->VirtQueueStages = ExAllocatePool2(POOL_FLAG_NON_PAGED, context->NumVirtQueues * sizeof(VGPU_QUEUE_STAGE), VIRTIO_VGPU_MEMORY_TAG);
+    ASSERT(context->VirtQueueStages != NULL);
+    for (size_t i = 0; i < context->NumVirtQueues; i++)
+    {
+        InitializeSListHead(&context->VirtQueueStages[i].StageList);
+        InitializeListHead(&context->VirtQueueStages[i].PendingList);
+
+        RtlZeroMemory(&context->QueuePolls[i], sizeof(VGPU_QUEUE_POLL));
+        context->QueuePolls[i].Context = context;
+        context->QueuePolls[i].QueueIndex = (ULONG32)i;
+        KeInitializeDpc(&context->QueuePolls[i].Dpc, VirtioVgpuPollDpc, &context->QueuePolls[i]);
+    }
+
     // get vgpu capabilities
     VirtIOWdfDeviceGet(&context->VDevice, FIELD_OFFSET(struct virtio_vgpu_config, capabilities), &context->Capabilities, sizeof(ULONG64));
 
+    // the last queue is reserved for transfers if the device supports it, COMMAND_QUEUE means no such queue
+    context->TransferQueueIndex = COMMAND_QUEUE;
+    if ((context->Capabilities & VIRTIO_VGPU_CAP_TRANSFER_QUEUE) && context->NumVirtQueues > CONTROL_QUEUE + 1)
+    {
+        context->TransferQueueIndex = context->NumVirtQueues - 1;
+    }
+
     // get vgpu memory config
     VirtIOWdfDeviceGet(&context->VDevice, FIELD_OFFSET(struct virtio_vgpu_config, memory_size), &vgpuMemorySize, sizeof(ULONG64));
 
@@ -417,10 +803,21 @@ NTSTATUS VirtioVgpuDevicePrepareHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
         }
     }
 
-    PsSetCreateProcessNotifyRoutine(ProcessNotify, FALSE);
     InitializeListHead(&VirglContextList);
     KeInitializeSpinLock(&VirglContextListSpinLock);
-    InitializeIdr();
+    status = InitializeEpoch();
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("InitializeEpoch failed status=0x%08x", status);
+        return status;
+    }
+
+    status = InitializeIdr();
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("InitializeIdr failed status=0x%08x", status);
+        return status;
+    }
 
     ExInitializeLookasideListEx(
         &context->VirglResourceLookAsideList,
@@ -443,6 +840,20 @@ NTSTATUS VirtioVgpuDevicePrepareHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
         0
     );
 
+    status = InitializeScheduler(context);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("InitializeScheduler failed status=0x%08x", status);
+        return status;
+    }
+
+    status = InitializeCompletionWorker(context);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("InitializeCompletionWorker failed status=0x%08x", status);
+        return status;
+    }
+
     return STATUS_SUCCESS;
 }
 
@@ -463,6 +874,9 @@ NTSTATUS VirtioVgpuDeviceReleaseHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
         VGPU_DEBUG_PRINT("virgl context list was not empty, it may cause memory leaked");
     }
 
+    UninitializeScheduler(context);
+    UninitializeCompletionWorker(context);
+
     if (context->VirtQueues)
     {
         ExFreePoolWithTag(context->VirtQueues, VIRTIO_VGPU_MEMORY_TAG);
@@ -475,6 +889,12 @@ NTSTATUS VirtioVgpuDeviceReleaseHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
         context->VirtQueueLocks = NULL;
     }
 
+    if (context->VirtQueueStages)
+    {
+        ExFreePoolWithTag(context->VirtQueueStages, VIRTIO_VGPU_MEMORY_TAG);
+        context->VirtQueueStages = NULL;
+    }
+
     if (Capsets.Data)
     {
         ExFreePoolWithTag(Capsets.Data, VIRTIO_VGPU_MEMORY_TAG);
@@ -488,9 +908,9 @@ NTSTATUS VirtioVgpuDeviceReleaseHardware(IN WDFDEVICE Device, IN WDFCMRESLIST Re
     }
 
     UnInitializeIdr();
+    UninitializeEpoch();
     ExDeleteLookasideListEx(&context->VirglResourceLookAsideList);
     ExDeleteLookasideListEx(&context->VgpuBufferLookAsideList);
-    PsSetCreateProcessNotifyRoutine(ProcessNotify, TRUE);
     VirtIOWdfShutdown(&context->VDevice);
 
     return STATUS_SUCCESS;
@@ -526,6 +946,7 @@ NTSTATUS VirtioVgpuDeviceD0Entry(IN WDFDEVICE Device, IN WDF_POWER_DEVICE_STATE
     if (NT_SUCCESS(status))
     {
         VirtIOWdfSetDriverOK(&context->VDevice);
+        context->bQueuesReady = TRUE;
     }
     else
     {
@@ -533,6 +954,16 @@ NTSTATUS VirtioVgpuDeviceD0Entry(IN WDFDEVICE Device, IN WDF_POWER_DEVICE_STATE
     }
     ExFreePoolWithTag(params, VIRTIO_VGPU_MEMORY_TAG);
 
+    // the polling thread reads the queues, it lives only while they exist
+    if (NT_SUCCESS(status))
+    {
+        status = VirtioVgpuStartPollThread(Device);
+        if (!NT_SUCCESS(status))
+        {
+            VGPU_DEBUG_LOG("VirtioVgpuStartPollThread failed status=0x%08x", status);
+        }
+    }
+
     return status;
 }
 
@@ -547,6 +978,18 @@ NTSTATUS VirtioVgpuDeviceD0Exit(IN WDFDEVICE Device, IN WDF_POWER_DEVICE_STATE T
 
     PAGED_CODE();
 
+    // a destroy handed over by the completion worker still sends commands and waits for the host
+    FlushDeferredDestroys(context);
+
+    // no poll may run once the queues are gone
+    VirtioVgpuStopPollThread(context);
+    context->bQueuesReady = FALSE;
+    for (ULONG32 i = 0; i < context->NumVirtQueues; i++)
+    {
+        KeRemoveQueueDpc(&context->QueuePolls[i].Dpc);
+    }
+    KeFlushQueuedDpcs();
+
     VirtIOWdfDestroyQueues(&context->VDevice);
 
     return STATUS_SUCCESS;
@@ -588,11 +1031,71 @@ VOID VirtioVgpuIoStop(IN WDFQUEUE Queue, IN WDFREQUEST Request, IN ULONG ActionF
     }
 }
 
+VOID VirtioVgpuSetInterruptAffinity(IN WDFDEVICE Device)
+{
+    NTSTATUS                        status;
+    WDFKEY                          key;
+    ULONG                           mask, group;
+    UNICODE_STRING                  valueName;
+    WDF_INTERRUPT_EXTENDED_POLICY   policy;
+    PDEVICE_CONTEXT                 context = GetDeviceContext(Device);
+    static const PCWSTR             valueNames[MAX_INTERRUPT_COUNT] = {
+        L"InterruptAffinity0", L"InterruptAffinity1", L"InterruptAffinity2", L"InterruptAffinity3"
+    };
+    static const PCWSTR             groupNames[MAX_INTERRUPT_COUNT] = {
+        L"InterruptGroup0", L"InterruptGroup1", L"InterruptGroup2", L"InterruptGroup3"
+    };
+
+    PAGED_CODE();
+
+    status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (!NT_SUCCESS(status))
+    {
+        return;
+    }
+
+    // the completion dpc runs where the interrupt is taken, keep it away from the render threads
+    for (UINT8 i = 0; i < MAX_INTERRUPT_COUNT; i++)
+    {
+        RtlInitUnicodeString(&valueName, valueNames[i]);
+        status = WdfRegistryQueryULong(key, &valueName, &mask);
+        if (!NT_SUCCESS(status) || mask == 0)
+        {
+            continue;
+        }
+
+        // the mask is relative to its processor group, group 0 when none is given
+        RtlInitUnicodeString(&valueName, groupNames[i]);
+        status = WdfRegistryQueryULong(key, &valueName, &group);
+        if (!NT_SUCCESS(status))
+        {
+            group = 0;
+        }
+
+        if (group >= KeQueryActiveGroupCount() || (mask & KeQueryGroupAffinity((USHORT)group)) != mask)
+        {
+            VGPU_DEBUG_LOG("queue=%d invalid interrupt affinity=0x%x group=%d", i, mask, group);
+            continue;
+        }
+
+        WDF_INTERRUPT_EXTENDED_POLICY_INIT(&policy);
+        policy.Policy = WdfIrqPolicySpecifiedProcessors;
+        policy.Priority = WdfIrqPriorityUndefined;
+        policy.TargetProcessorSetAndGroup.Mask = mask;
+        policy.TargetProcessorSetAndGroup.Group = (USHORT)group;
+        WdfInterruptSetExtendedPolicy(context->WdfInterrupt[i], &policy);
+        VGPU_DEBUG_LOG("queue=%d interrupt affinity=0x%x group=%d", i, mask, group);
+    }
+
+    WdfRegistryClose(key);
+}
+
 NTSTATUS VirtioVgpuDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
 {
     NTSTATUS                        status;
     WDFDEVICE                       device;
     WDF_PNPPOWER_EVENT_CALLBACKS    pnpPowerCallbacks;
+    WDF_FILEOBJECT_CONFIG           fileConfig;
     WDF_OBJECT_ATTRIBUTES           attributes;
     WDFQUEUE                        queue;
     WDF_IO_QUEUE_CONFIG             queueConfig;
@@ -610,6 +1113,11 @@ NTSTATUS VirtioVgpuDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
     WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoDirect);
 
+    // the virgl contexts live in the file objects, one per handle
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK, VirtioVgpuFileCleanup);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, FILE_CONTEXT);
+    WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &attributes);
+
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DEVICE_CONTEXT);
     attributes.EvtCleanupCallback = VirtioVgpuDeviceContextCleanup;
 
@@ -639,6 +1147,7 @@ NTSTATUS VirtioVgpuDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
             return status;
         }
     }
+    VirtioVgpuSetInterruptAffinity(device);
 
     // WdfIoQueueDispatchSequential vs WdfIoQueueDispatchParallel
     // WdfIoQueueDispatchParallel may conflict with "indirect page" in virtio
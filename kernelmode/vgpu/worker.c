@@ -0,0 +1,217 @@
+/*
+ * MVisor vgpu Device guest driver
+ * Copyright (C) 2022 cair <rui.cai@tenclass.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "control.h"
+#include "command.h"
+#include "worker.h"
+
+// not a virtio command type, the flusher waits for the worker to reach it
+#define COMPLETION_WORK_FLUSH   0
+
+VOID CompleteWork(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer)
+{
+    KIRQL                       oldIrql;
+    BOOLEAN                     bReferenced = FALSE;
+    PVIRGL_CONTEXT              virglContext;
+    PVIRGL_RESOURCE             resource = NULL;
+    struct virtio_gpu_ctrl_hdr* header = (struct virtio_gpu_ctrl_hdr*)Buffer->pBuf;
+
+    if (header->type == COMPLETION_WORK_FLUSH)
+    {
+        // the buffer belongs to the flusher
+        KeSetEvent(&Buffer->Event, IO_NO_INCREMENT, FALSE);
+        return;
+    }
+
+    // only the lookups run in the epoch section, the work below needs passive level
+    EpochEnter(&oldIrql);
+    virglContext = GetVirglContextFromListUnsafe(header->ctx_id);
+    if (virglContext && EpochTryReference(&virglContext->RefCount))
+    {
+        bReferenced = TRUE;
+        if (header->type == VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB)
+        {
+            resource = GetResourceFromListUnsafe(virglContext, ((struct virtio_gpu_resource_map_blob*)Buffer->pBuf)->resource_id);
+            if (resource && !EpochTryReference(&resource->RefCount))
+            {
+                resource = NULL;
+            }
+        }
+    }
+    else if (virglContext && header->type == VIRTIO_GPU_CMD_SUBMIT_3D)
+    {
+        // the context is being destroyed and drains its resources, idle them without the reference
+        UpdateResourceState(virglContext, Buffer->ResourceIds, Buffer->ResourceIdsCount, FALSE);
+    }
+    else if (virglContext && header->type == VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB)
+    {
+        // a blob of a dying context is not mapped anymore, its pending map is done though
+        UpdateResourceState(virglContext, &((struct virtio_gpu_resource_map_blob*)Buffer->pBuf)->resource_id, 1, FALSE);
+    }
+    EpochExit(oldIrql);
+
+    switch (header->type)
+    {
+    case VIRTIO_GPU_CMD_RESOURCE_MAP_BLOB:
+        if (resource)
+        {
+            struct virtio_gpu_resp_map_info* resp = (struct virtio_gpu_resp_map_info*)Buffer->pRespBuf;
+            MapBlobResourceCallback(virglContext, resource, resp->gpa, resp->size, resp->map_info);
+            PutResource(virglContext, resource);
+        }
+        break;
+    case VIRTIO_GPU_CMD_SUBMIT_3D:
+        // the rest of the submission was retired in the dpc
+        if (bReferenced)
+        {
+            UpdateResourceStatePassive(virglContext, Buffer->ResourceIds, Buffer->ResourceIdsCount, FALSE);
+        }
+        ExFreePoolWithTag(Buffer->ResourceIds, VIRTIO_VGPU_MEMORY_TAG);
+        break;
+    default:
+        VGPU_DEBUG_LOG("unexpected work cmd type=%d", header->type);
+        break;
+    }
+
+    if (bReferenced)
+    {
+        PutVirglContextDeferred(virglContext);
+    }
+
+    FreeCommandBuffer(Context, Buffer);
+}
+
+VOID CompletionWorkRoutine(PVOID StartContext)
+{
+    PSLIST_ENTRY    entry, next, works;
+    PDEVICE_CONTEXT context = StartContext;
+
+    while (TRUE)
+    {
+        KeWaitForSingleObject(&context->CompletionWorkEvent, Executive, KernelMode, FALSE, NULL);
+
+        // the list is lifo, reverse it to complete in the order of the dpc
+        works = NULL;
+        entry = InterlockedFlushSList(&context->CompletionWorkList);
+        while (entry)
+        {
+            next = entry->Next;
+            entry->Next = works;
+            works = entry;
+            entry = next;
+        }
+
+        for (entry = works; entry; entry = next)
+        {
+            next = entry->Next;
+            CompleteWork(context, CONTAINING_RECORD(entry, VGPU_BUFFER, StageEntry));
+        }
+
+        if (context->bCompletionWorkStop)
+        {
+            break;
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS InitializeCompletionWorker(PDEVICE_CONTEXT Context)
+{
+    NTSTATUS    status;
+    HANDLE      threadHandle;
+
+    InitializeSListHead(&Context->CompletionWorkList);
+    KeInitializeEvent(&Context->CompletionWorkEvent, SynchronizationEvent, FALSE);
+    Context->bCompletionWorkStop = FALSE;
+
+    status = PsCreateSystemThread(&threadHandle, THREAD_ALL_ACCESS, NULL, NULL, NULL, CompletionWorkRoutine, Context);
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("PsCreateSystemThread failed status=0x%08x", status);
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle, THREAD_ALL_ACCESS, NULL, KernelMode, &Context->CompletionWorkThread, NULL);
+    ZwClose(threadHandle);
+
+    if (!NT_SUCCESS(status))
+    {
+        VGPU_DEBUG_LOG("ObReferenceObjectByHandle failed status=0x%08x", status);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID UninitializeCompletionWorker(PDEVICE_CONTEXT Context)
+{
+    if (!Context->CompletionWorkThread)
+    {
+        return;
+    }
+
+    // the worker completes what is left before it exits
+    Context->bCompletionWorkStop = TRUE;
+    KeSetEvent(&Context->CompletionWorkEvent, IO_NO_INCREMENT, FALSE);
+
+    KeWaitForSingleObject(Context->CompletionWorkThread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(Context->CompletionWorkThread);
+    Context->CompletionWorkThread = NULL;
+}
+
+// hand heavy completion work over to passive level, the buffer is freed by the worker
+VOID QueueCompletionWork(PDEVICE_CONTEXT Context, PVGPU_BUFFER Buffer)
+{
+    InterlockedPushEntrySList(&Context->CompletionWorkList, &Buffer->StageEntry);
+    KeSetEvent(&Context->CompletionWorkEvent, IO_NO_INCREMENT, FALSE);
+}
+
+// wait until the worker has completed everything queued before
+VOID FlushCompletionWork(PDEVICE_CONTEXT Context)
+{
+    PVGPU_BUFFER buffer;
+
+    if (!Context->CompletionWorkThread)
+    {
+        return;
+    }
+
+    buffer = AllocateCommandBuffer(Context, sizeof(struct virtio_gpu_ctrl_hdr), 0, TRUE, NULL);
+    ((struct virtio_gpu_ctrl_hdr*)buffer->pBuf)->type = COMPLETION_WORK_FLUSH;
+
+    QueueCompletionWork(Context, buffer);
+    KeWaitForSingleObject(&buffer->Event, Executive, KernelMode, FALSE, NULL);
+    FreeCommandBuffer(Context, buffer);
+}
+
+// a context whose last reference was dropped by the worker is destroyed later, the destroy still needs the queues
+VOID FlushDeferredDestroys(PDEVICE_CONTEXT Context)
+{
+    LARGE_INTEGER interval;
+
+    // the worker holds no reference after this, so no destroy can be deferred anymore
+    FlushCompletionWork(Context);
+
+    interval.QuadPart = -10000LL;
+    while (Context->DestroyPendingCount > 0)
+    {
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+}
\ No newline at end of file